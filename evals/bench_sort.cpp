@@ -0,0 +1,89 @@
+// Benchmark of sorting the matches of a read: pdqsort_branchless (the
+// comparison sort) against radix_sort on the packed (segment, position) key.
+// Build and run with `make bench_sort`.
+//
+// Match counts per read span a few dozen (short, unique reads) to 10^5-10^6
+// (long reads in repeats). The distributions of the hit positions:
+//   unique:   uniform over one 100 Mbp segment,
+//   genome:   uniform over 24 segments of 50-250 Mbp,
+//   repeats:  in 50 copies of a 20 kbp region, as for a read in a repeat.
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../ext/pdqsort.h"
+#include "../src/index.h"
+#include "../src/radix_sort.h"
+
+using namespace sweepmap;
+
+static std::vector<Match> gen_matches(const std::string &dist, size_t n, std::mt19937_64 &rng) {
+	std::vector<Match> matches;
+	matches.reserve(n);
+	const Seed seed(Kmer(0, 0, false), 0, 0, 1);
+	for (size_t i = 0; i < n; i++) {
+		Hit hit;
+		hit.strand = rng() & 1;
+		if (dist == "unique") {
+			hit.segm_id = 0;
+			hit.r = rng() % 100'000'000;
+		} else if (dist == "genome") {
+			hit.segm_id = rng() % 24;
+			hit.r = rng() % (50'000'000 + 10'000'000 * hit.segm_id);
+		} else {
+			hit.segm_id = rng() % 3;
+			hit.r = (rng() % 50) * 1'000'000 + rng() % 20'000;
+		}
+		matches.push_back(Match(seed, hit, int(i)));
+	}
+	return matches;
+}
+
+template<typename SortFn>
+static double ns_per_match(const std::vector<Match> &input, SortFn sort) {
+	const size_t reps = std::max<size_t>(1, 4'000'000 / input.size());
+	std::vector<Match> work;
+	double secs = 0.0;
+	for (size_t r = 0; r < reps; r++) {
+		work = input;
+		auto start = std::chrono::high_resolution_clock::now();
+		sort(work);
+		secs += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+	return 1e9 * secs / double(reps * input.size());
+}
+
+int main() {
+	std::mt19937_64 rng(42);
+	std::vector<Match> buf;
+	printf("%-8s %9s %12s %12s %8s\n", "dist", "matches", "pdqsort[ns]", "radix[ns]", "speedup");
+	for (std::string dist: {"unique", "genome", "repeats"}) {
+		for (size_t n: {16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576}) {
+			const auto input = gen_matches(dist, n, rng);
+			buf.resize(n, input[0]);
+
+			const double pdq = ns_per_match(input, [](std::vector<Match> &m) {
+				pdqsort_branchless(m.begin(), m.end(), [](const Match &a, const Match &b) { return a.key < b.key; });
+			});
+			const double radix = ns_per_match(input, [&](std::vector<Match> &m) {
+				radix_sort(m.data(), buf.data(), m.size(), [](const Match &a) { return a.key; });
+			});
+
+			// both orders are the same since the keys of the matches of a read are unique
+			auto a = input, b = input;
+			pdqsort_branchless(a.begin(), a.end(), [](const Match &x, const Match &y) { return x.key < y.key; });
+			radix_sort(b.data(), buf.data(), b.size(), [](const Match &x) { return x.key; });
+			for (size_t i = 0; i < n; i++)
+				if (a[i].key != b[i].key) {
+					fprintf(stderr, "ERROR: different order for %s, n=%zu\n", dist.c_str(), n);
+					return 1;
+				}
+
+			printf("%-8s %9zu %12.1f %12.1f %7.2fx\n", dist.c_str(), n, pdq, radix, pdq / radix);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+# Chunked mapping (--chunk_len) of long reads from unique loci: all chunks of
+# a read have to join into one chain that spans the whole read. The loci are
+# interspersed with copies of a short repeat, which pull the ends of the
+# sweep windows of the chunks away from the diagonal of the read.
+#
+# usage: test_chunking.py [SWEEPMAP_BIN]
+
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+SWEEPMAP = sys.argv[1] if len(sys.argv) > 1 else './sweepmap'
+CONTIGS, CONTIG_LEN = 3, 300_000
+READ_LEN = 100_000
+SUBST, INS, DEL = 0.02, 0.06, 0.02  # CLR-like errors, biased to insertions
+CHUNK_LENS = [2000, 3000, 10000]
+MODES = [['-x'], ['-t', '0.3']]
+REPEAT_LEN, REPEAT_EVERY = 1000, 3_000  # copies of one short repeat per bp on average
+TOLERANCE = READ_LEN // 100  # at the ends of the read and of its locus
+
+rnd = random.Random(42)
+
+def revcomp(s):
+    return s[::-1].translate(str.maketrans('ACGT', 'TGCA'))
+
+def mutate(s):
+    out = []
+    for c in s:
+        x = rnd.random()
+        if x < SUBST:
+            out.append(rnd.choice('ACGT'.replace(c, '')))
+        elif x < SUBST + INS:
+            out.append(c + rnd.choice('ACGT'))
+        elif x >= SUBST + INS + DEL:
+            out.append(c)
+    return ''.join(out)
+
+def main():
+    repeat = ''.join(rnd.choice('ACGT') for _ in range(REPEAT_LEN))
+    ref = []
+    for _ in range(CONTIGS):
+        contig = [rnd.choice('ACGT') for _ in range(CONTIG_LEN)]
+        for _ in range(CONTIG_LEN // REPEAT_EVERY):
+            pos = rnd.randrange(CONTIG_LEN - REPEAT_LEN)
+            contig[pos:pos + REPEAT_LEN] = repeat
+        ref.append(''.join(contig))
+    reads = []
+    for i, strand in enumerate('+-+-'):
+        segm = i % CONTIGS
+        start = rnd.randrange(CONTIG_LEN - READ_LEN)
+        seq = mutate(ref[segm][start:start + READ_LEN])
+        reads.append((f'r{i}!chr{segm}!{start}!{start + READ_LEN}!{strand}', seq if strand == '+' else revcomp(seq)))
+
+    failed = 0
+    with tempfile.TemporaryDirectory() as tmp:
+        ref_fa, reads_fa = os.path.join(tmp, 'ref.fa'), os.path.join(tmp, 'reads.fa')
+        with open(ref_fa, 'w') as f:
+            for segm, seq in enumerate(ref):
+                f.write(f'>chr{segm}\n{seq}\n')
+        with open(reads_fa, 'w') as f:
+            for name, seq in reads:
+                f.write(f'>{name}\n{seq}\n')
+
+        for chunk_len in CHUNK_LENS:
+            for mode in MODES:
+                cmd = [SWEEPMAP, '-s', ref_fa, '-p', reads_fa, '-k', '22', '-r', '0.1', '--chunk_len', str(chunk_len)] + mode
+                paf = subprocess.run(cmd, capture_output=True, text=True, check=True).stdout
+                mappings = {}
+                for line in paf.splitlines():
+                    f = line.split('\t')
+                    mappings.setdefault(f[0], []).append(f)
+                for name, seq in reads:
+                    _, chrom, start, end, strand = name.split('!')
+                    m = mappings.get(name, [])
+                    ok = (len(m) == 1
+                        and int(m[0][2]) <= TOLERANCE and int(m[0][3]) >= len(seq) - TOLERANCE
+                        and m[0][4] == strand and m[0][5] == chrom
+                        and abs(int(m[0][7]) - int(start)) <= TOLERANCE and abs(int(m[0][8]) - int(end)) <= TOLERANCE)
+                    if not ok:
+                        failed += 1
+                        print(f'FAIL --chunk_len {chunk_len} {" ".join(mode)} {name}:', *['\t'.join(f[:9]) for f in m] or ['unmapped'], sep='\n  ')
+
+    print('test_chunking:', 'FAILED' if failed else 'OK')
+    return 1 if failed else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
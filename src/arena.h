@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <vector>
+
+namespace sweepmap {
+
+// Arena -- the memory of the containers of one read (seeds, matches,
+// histogram, mappings). An allocation bumps a pointer in the current block
+// and deallocation does nothing; reset() frees everything at once when the
+// read is done. The blocks are kept for the next reads, so once the arena
+// has grown to the largest read, mapping a read calls no allocator.
+// Not thread-safe: every mapping thread has its own arena.
+class Arena : public std::pmr::memory_resource {
+	static constexpr size_t MIN_BLOCK = 1 << 20;
+
+	struct Block {
+		std::unique_ptr<std::byte[]> mem;
+		size_t size;
+	};
+
+	std::vector<Block> blocks;
+	size_t curr = 0;   // the block that allocations come from
+	size_t used = 0;   // bytes used in the current block
+
+	void *do_allocate(size_t bytes, size_t align) override {
+		while (true) {
+			if (curr < blocks.size()) {
+				const uintptr_t base = reinterpret_cast<uintptr_t>(blocks[curr].mem.get());
+				const uintptr_t p = (base + used + align - 1) & ~uintptr_t(align - 1);
+				if (p + bytes <= base + blocks[curr].size) {
+					used = p + bytes - base;
+					return reinterpret_cast<void*>(p);
+				}
+				// the rest of the block stays unused until the next reset()
+				++curr;
+				used = 0;
+			} else {
+				const size_t size = std::max({MIN_BLOCK, bytes + align, blocks.empty() ? 0 : 2*blocks.back().size});
+				blocks.push_back(Block{std::unique_ptr<std::byte[]>(new std::byte[size]), size});
+			}
+		}
+	}
+
+	void do_deallocate(void *, size_t, size_t) override {}
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+		return this == &other;
+	}
+
+public:
+	Arena() = default;
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+
+	// Frees all allocations; the containers allocated from the arena must be destroyed.
+	void reset() {
+		curr = 0;
+		used = 0;
+	}
+
+	size_t capacity() const {
+		size_t total = 0;
+		for (const auto &b: blocks)
+			total += b.size;
+		return total;
+	}
+};
+
+} // namespace sweepmap
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+
+namespace sweepmap {
+
+// Runtime selection of the instruction set for the hot kernels, so that one
+// portable build (e.g. -march=x86-64-v2) runs the AVX2 and AVX-512 code
+// paths on the machines that have them.
+//  * MULTIVERSION clones a function for each x86-64 level; the dynamic
+//    loader picks the best clone for the CPU once (ifunc).
+//  * Kernels written for a specific vector width (the batch sketching) are
+//    compiled with a target attribute and called only if cpu_isa() allows.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(SWEEPMAP_NO_MULTIVERSION)
+	#define SWEEPMAP_X86
+	#define MULTIVERSION __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "arch=x86-64-v2", "default")))
+	#define TARGET_AVX512 __attribute__((target("arch=x86-64-v4"), flatten))
+#else
+	#define MULTIVERSION
+	#define TARGET_AVX512
+#endif
+
+// x86-64 microarchitecture levels: v2 has SSE4.2, v3 has AVX2 and BMI2, v4 has AVX-512.
+enum class Isa { BASELINE, SSE42, AVX2, AVX512 };
+
+inline std::string isa_name(Isa isa) {
+	switch (isa) {
+		case Isa::BASELINE: return "baseline";
+		case Isa::SSE42:    return "sse4.2 (x86-64-v2)";
+		case Isa::AVX2:     return "avx2 (x86-64-v3)";
+		case Isa::AVX512:   return "avx512 (x86-64-v4)";
+	}
+	return "unknown";
+}
+
+// The best level supported by the CPU; the same choice as the MULTIVERSION clones.
+inline Isa cpu_isa() {
+	static const Isa isa = [] {
+#ifdef SWEEPMAP_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("x86-64-v4")) return Isa::AVX512;
+		if (__builtin_cpu_supports("x86-64-v3")) return Isa::AVX2;
+		if (__builtin_cpu_supports("x86-64-v2")) return Isa::SSE42;
+#endif
+		return Isa::BASELINE;
+	}();
+	return isa;
+}
+
+// The level the whole binary was compiled for (-march).
+inline Isa build_isa() {
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+	return Isa::AVX512;
+#elif defined(__AVX2__)
+	return Isa::AVX2;
+#elif defined(__SSE4_2__)
+	return Isa::SSE42;
+#else
+	return Isa::BASELINE;
+#endif
+}
+
+inline void print_cpu_report(std::ostream &out) {
+	out << "CPU:" << std::endl;
+#ifdef SWEEPMAP_X86
+	__builtin_cpu_init();
+	out << " | features:              ";
+	// __builtin_cpu_supports needs a string literal
+	#define REPORT_FEATURE(f) if (__builtin_cpu_supports(f)) out << f << " ";
+	REPORT_FEATURE("sse4.2") REPORT_FEATURE("popcnt") REPORT_FEATURE("avx2") REPORT_FEATURE("bmi2") REPORT_FEATURE("fma")
+	REPORT_FEATURE("avx512f") REPORT_FEATURE("avx512bw") REPORT_FEATURE("avx512vl") REPORT_FEATURE("avx512dq")
+	#undef REPORT_FEATURE
+	out << std::endl;
+	out << " | multiversioning:       on" << std::endl;
+#else
+	out << " | multiversioning:       off" << std::endl;
+#endif
+	out << " | build baseline:        " << isa_name(build_isa()) << std::endl;
+	out << " | selected:              " << isa_name(cpu_isa()) << std::endl;
+	out << " |  | sketching:              " << (cpu_isa() >= Isa::AVX512 ? "8 reads per batch in 512-bit lanes" : "one read at a time") << std::endl;
+	out << " |  | seeding, matching, sweep: " << isa_name(cpu_isa()) << " clone" << std::endl;
+}
+
+} // namespace sweepmap
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+
+namespace sweepmap {
+
+// DiffHist -- the histogram of the sweep: for every seed, its multiplicity
+// in the pattern minus its matches in the current window. The counts are
+// small, so they take one byte each and the histogram of a read with
+// thousands of seeds stays in L1. A count outside of [-127, 127] moves to
+// the side table `wide` for the rest of the read and its byte is set to
+// WIDE; the side table is allocated on the first such count.
+class DiffHist {
+	static constexpr int8_t WIDE = INT8_MIN;
+	static constexpr int MAX = INT8_MAX;
+
+	std::pmr::vector<int8_t> small;
+	std::pmr::vector<int> wide;
+
+	int &widen(size_t i) {
+		if (wide.empty())
+			wide.resize(small.size());
+		if (small[i] != WIDE) {
+			wide[i] = small[i];
+			small[i] = WIDE;
+		}
+		return wide[i];
+	}
+
+public:
+	DiffHist(const std::pmr::vector<int> &counts, std::pmr::memory_resource *mr)
+		: small(counts.size(), 0, mr), wide(mr) {
+		for (size_t i = 0; i < counts.size(); i++) {
+			if (-MAX <= counts[i] && counts[i] <= MAX)
+				small[i] = int8_t(counts[i]);
+			else
+				widen(i) = counts[i];
+		}
+	}
+
+	DiffHist(const DiffHist &other, std::pmr::memory_resource *mr)
+		: small(other.small, mr), wide(other.wide, mr) {}
+
+	// Decrements the count of seed `i` and returns whether it is still non-negative.
+	inline bool dec(size_t i) {
+		int8_t &c = small[i];
+		if (__builtin_expect(c > -MAX, 1))  // neither WIDE nor at the bottom
+			return --c >= 0;
+		return --widen(i) >= 0;
+	}
+
+	// Increments the count of seed `i` and returns whether it is positive.
+	inline bool inc(size_t i) {
+		int8_t &c = small[i];
+		if (__builtin_expect(c != WIDE && c < MAX, 1))
+			return ++c > 0;
+		return ++widen(i) > 0;
+	}
+
+	int operator[](size_t i) const { return small[i] == WIDE ? wide[i] : small[i]; }
+	size_t size() const { return small.size(); }
+};
+
+} // namespace sweepmap
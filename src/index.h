@@ -1,6 +1,8 @@
 #pragma once
 
+#include <algorithm>
 #include <iostream>
+#include <memory_resource>
 #include <string>
 #include <vector>
 
@@ -34,16 +36,86 @@ struct Seed {
 		kmer(kmer), r_first(r_first), r_last(r_last), hits_in_T(hits_in_T) {}	
 };
 
-// Match -- a pair of a seed and a hit
+// Match -- a pair of a seed and a hit, packed into 16 bytes for sorting and
+// sweeping: the position of the hit as a sortable key and the seed by its
+// number among the chosen seeds, whose metadata stays in the seeds.
 struct Match {
-	Seed seed;
-	Hit hit;
-	int seed_num; // seed number among the chosen seeds, used for indexing the histogram
+	uint64_t key;      // segm_id << 32 | hit.r: sorted by segment, then by position
+	uint32_t payload;  // seed_num << 1 | same strand
 	Match(const Seed &seed, const Hit &hit, int seed_num)
-		: seed(seed), hit(hit), seed_num(seed_num) {}
-	
-	inline bool is_same_strand() const {
-		return seed.kmer.strand == hit.strand;
+		: key(uint64_t(uint8_t(hit.segm_id)) << 32 | uint32_t(hit.r)),
+		  payload(uint32_t(seed_num) << 1 | uint32_t(seed.kmer.strand == hit.strand)) {}
+
+	inline segm_t segm_id() const { return segm_t(key >> 32); }
+	inline pos_t hit_r() const { return pos_t(uint32_t(key)); }
+	inline int seed_num() const { return int(payload >> 1); } // used for indexing the histogram
+	inline void set_seed_num(int seed_num) { payload = uint32_t(seed_num) << 1 | (payload & 1); }
+	inline bool is_same_strand() const { return payload & 1; }
+};
+static_assert(sizeof(Match) == 16);
+
+// The per-read containers draw from the arena of the mapping thread.
+using seeds_t = std::pmr::vector<Seed>;
+using matches_t = std::pmr::vector<Match>;
+
+// HitTable -- the hits of all indexed kmers in one array, found through an
+// open-addressing table of hashes (linear probing, at most 3/4 full). Unlike
+// a lookup in a hash map, the slot of a hash is known before reading it, so
+// the lookups of many seeds can be prefetched and overlapped.
+class HitTable {
+	struct Slot {
+		hash_t h;
+		uint32_t from, cnt;  // hits[from, from+cnt); cnt=0 for an empty slot
+	};
+
+	std::vector<Slot> slots;
+	std::vector<Hit> hits;
+	size_t mask = 0;
+	int shift = 64;
+
+	// The sampled hashes are not uniform in their high bits (FracMinHash keeps
+	// the smallest ones), so the slot is taken from a multiplicative mix.
+	size_t home(hash_t h) const {
+		return size_t((h * 0x9E3779B97F4A7C15ull) >> shift);
+	}
+
+public:
+	struct Hits {
+		const Hit *first;
+		uint32_t cnt;
+		const Hit *begin() const { return first; }
+		const Hit *end() const { return first + cnt; }
+	};
+
+	void add(hash_t h, const Hit *first, size_t cnt) {
+		size_t i = home(h);
+		while (slots[i].cnt)
+			i = (i + 1) & mask;
+		slots[i] = Slot{h, uint32_t(hits.size()), uint32_t(cnt)};
+		hits.insert(hits.end(), first, first + cnt);
+	}
+
+	void init(size_t kmers, size_t total_hits) {
+		size_t sz = 2;
+		shift = 63;
+		while (3*sz < 4*kmers)
+			sz *= 2, --shift;
+		slots.assign(sz, Slot{0, 0, 0});
+		mask = sz - 1;
+		hits.clear();
+		hits.reserve(total_hits);
+	}
+
+	Hits find(hash_t h) const {
+		for (size_t i = home(h); slots[i].cnt; i = (i + 1) & mask)
+			if (slots[i].h == h)
+				return Hits{&hits[slots[i].from], slots[i].cnt};
+		return Hits{nullptr, 0};
+	}
+
+	// The first address read by find(h).
+	const void *slot_addr(hash_t h) const {
+		return &slots[home(h)];
 	}
 };
 
@@ -63,6 +135,7 @@ public:
 	const params_t &params;
 	ankerl::unordered_dense::map<hash_t, Hit> h2single;               // all sketched kmers with =1 hit
 	ankerl::unordered_dense::map<hash_t, std::vector<Hit>> h2multi;   // all sketched kmers with >1 hits
+	HitTable hit_table;  // the same hits for the lookups of the mapping; built by finalize()
 	Timers *timer;
 	Counters *C;
 
@@ -86,22 +159,69 @@ public:
 	}
 
 	int count(hash_t h) const {
-		if (h2single.contains(h)) return 1;
-		else if (h2multi.contains(h)) return h2multi.at(h).size();
-		else return 0;
+		return hit_table.find(h).cnt;
+	}
+
+	HitTable::Hits hits(hash_t h) const {
+		return hit_table.find(h);
+	}
+
+	// The address to prefetch before a lookup of `h`.
+	const void *lookup_addr(hash_t h) const {
+		return hit_table.slot_addr(h);
+	}
+
+	void add_matches(matches_t *matches, const Seed &s, int seed_num) const {
+		assert(s.hits_in_T > 0);
+		for (const auto &hit: hits(s.kmer.h))
+			matches->push_back(Match(s, hit, seed_num));
 	}
 
-	void add_matches(std::vector<Match> *matches, const Seed &s, int seed_num) const {
-		if (s.hits_in_T == 1) {
-			assert(h2single.contains(s.kmer.h));
-			matches->push_back(Match(s, h2single.at(s.kmer.h), seed_num));
-				
-		} else {
-			assert(s.hits_in_T > 1);
-			assert(h2multi.contains(s.kmer.h));
-			for (const auto &hit: h2multi.at(s.kmer.h))
-				matches->push_back(Match(s, hit, seed_num));
-		}	
+	// Moves the hits from the maps to the hit table; the hits of a kmer are
+	// sorted by segment and position.
+	void build_hit_table() {
+		size_t total_hits = h2single.size();
+		for (const auto &[h, hits]: h2multi)
+			total_hits += hits.size();
+		hit_table.init(h2single.size() + h2multi.size(), total_hits);
+		for (const auto &[h, hit]: h2single)
+			hit_table.add(h, &hit, 1);
+		h2single = {};
+		for (auto &[h, hits]: h2multi) {
+			// by position, for the lookups restricted to regions
+			std::sort(hits.begin(), hits.end(), [](const Hit &a, const Hit &b) {
+				return a.segm_id != b.segm_id ? a.segm_id < b.segm_id : a.r < b.r;
+			});
+			hit_table.add(h, hits.data(), hits.size());
+		}
+		h2multi = {};
+	}
+
+	// add_matches() of only the hits inside the regions [first, last), which
+	// are disjoint and sorted by segment and position like the hits of a kmer
+	// (a region has `segm_id`, `from` and `to`, inclusive). One lookup per
+	// seed, and the two sorted lists are merged: both skip ahead by binary
+	// search, so many regions cost little for a seed with few hits and many
+	// hits little for few regions.
+	template<typename RegionIt>
+	void add_matches_in(matches_t *matches, const Seed &s, int seed_num, RegionIt first, RegionIt last) const {
+		const auto hits = this->hits(s.kmer.h);
+		auto hit = hits.begin();
+		auto region = first;
+		while (hit != hits.end() && region != last) {
+			if (hit->segm_id < region->segm_id || (hit->segm_id == region->segm_id && hit->r < region->from)) {
+				hit = std::lower_bound(hit, hits.end(), *region, [](const Hit &h, const auto &region) {
+					return h.segm_id != region.segm_id ? h.segm_id < region.segm_id : h.r < region.from;
+				});
+			} else if (hit->segm_id > region->segm_id || hit->r > region->to) {
+				region = std::lower_bound(region, last, *hit, [](const auto &region, const Hit &h) {
+					return region.segm_id != h.segm_id ? region.segm_id < h.segm_id : region.to < h.r;
+				});
+			} else {
+				matches->push_back(Match(s, *hit, seed_num));
+				++hit;
+			}
+		}
 	}
 
 	void erase_frequent_kmers() {
@@ -144,9 +264,9 @@ public:
 
 	void build_index(const std::string &tFile) {
 		timer->start("indexing");
-		cerr << "Indexing " << params.tFile << "..." << endl;
+		cerr << "Indexing " << tFile << "..." << endl;
 		timer->start("index_reading");
-		read_fasta_klib(params.tFile, [this](kseq_t *seq) {
+		read_fasta_klib(tFile, [this](kseq_t *seq) {
 			timer->stop("index_reading");
 			timer->start("index_sketching");
 			Sketch t(seq->seq.s);
@@ -158,7 +278,43 @@ public:
 
 			timer->start("index_reading");
 		});
+		timer->stop("index_reading");
+		finalize();
+		timer->stop("indexing");
+	}
+
+	// Builds one index per kmer length with a single pass over `tFile`,
+	// sketching every segment for all k at once. The k of each index is
+	// taken from its own params.
+	static void build_indexes(const std::string &tFile, const std::vector<SketchIndex*> &indexes, Timers *timer) {
+		std::vector<int> ks;
+		for (const auto *idx: indexes)
+			ks.push_back(idx->params.k);
+		const double hFrac = indexes.front()->params.hFrac;
+
+		timer->start("indexing");
+		cerr << "Indexing " << tFile << " for " << ks.size() << " kmer lengths..." << endl;
+		timer->start("index_reading");
+		read_fasta_klib(tFile, [&](kseq_t *seq) {
+			timer->stop("index_reading");
+			timer->start("index_sketching");
+			auto sketches = Sketch::buildSketches(seq->seq.s, ks, hFrac);
+			timer->stop("index_sketching");
+
+			timer->start("index_initializing");
+			for (size_t i = 0; i < indexes.size(); i++)
+				indexes[i]->add_segment(seq, Sketch(std::move(sketches[i])));
+			timer->stop("index_initializing");
+
+			timer->start("index_reading");
+		});
+		timer->stop("index_reading");
+		for (auto *idx: indexes)
+			idx->finalize();
+		timer->stop("indexing");
+	}
 
+	void finalize() {
 		// if a kmer is present in both single and multi, we move it out of single to multi
 		for (auto &[h, hits] : h2multi) {
 			if (h2single.contains(h)) {
@@ -166,19 +322,18 @@ public:
 				h2single.erase(h);
 			}
 		}
-		timer->stop("index_reading");
-		timer->stop("indexing");
 
 		get_kmer_stats();
         C->inc("blacklisted_kmers", 0);
         C->inc("blacklisted_hits", 0);
 		erase_frequent_kmers();
+		build_hit_table();
 		print_stats();
 	}
 
 	void print_stats() {
 		cerr << std::fixed << std::setprecision(1);
-		cerr << "Index stats:" << endl;
+		cerr << "Index stats (k=" << params.k << "):" << endl;
         printMemoryUsage();
 		cerr << " | total nucleotides:     " << C->count("total_nucls") << endl;
 		cerr << " | index segments:        " << C->count("segments") << " (~" << 1.0*C->count("total_nucls") / C->count("segments") << " nb per segment)" << endl;
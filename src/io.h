@@ -3,7 +3,9 @@
 #include <fstream>
 #include <functional>
 #include <getopt.h>
+#include <cmath>
 #include <iomanip>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -20,7 +22,22 @@ using std::pair;
 using std::ifstream;
 using std::endl;
 
-#define T_HOM_OPTIONS "p:s:k:r:S:M:t:z:aonxh"
+#define T_HOM_OPTIONS "p:s:k:r:S:M:t:z:O:m:T:aonxh"
+
+// Options with only a long name
+enum { OPT_CPU_REPORT = 1000, OPT_COARSE, OPT_MATCH_BUDGET, OPT_SEEDS_PER_KB, OPT_MIN_SEEDS, OPT_SEED_BINS, OPT_CHUNK_LEN, OPT_TOP };
+
+// Kmer sampling scheme of the sketches
+enum class Sampling : uint8_t { FMH, OPEN_SYNCMER, CLOSED_SYNCMER };
+
+inline string sampling_name(Sampling sampling) {
+	switch (sampling) {
+		case Sampling::FMH:            return "fmh";
+		case Sampling::OPEN_SYNCMER:   return "open_syncmer";
+		case Sampling::CLOSED_SYNCMER: return "closed_syncmer";
+	}
+	return "unknown";
+}
 
 struct params_t {
 	// required
@@ -28,11 +45,22 @@ struct params_t {
 
 	// with an argument:
 	int k;							// The k-mer length
-	double hFrac;					// The FracMinHash ratio
+	std::vector<int> ks;			// All k-mer lengths for a multi-k run (-k 14,16,18), ks[0] == k
+	double hFrac;					// The FracMinHash ratio (the target density for syncmers)
+	Sampling sampling;				// The kmer sampling scheme
 	int max_seeds; 					// Maximum seeds in a sketch
+	double seeds_per_kb;			// Seed limit per kb of a read, clamped to [min_seeds; max_seeds] (0: max_seeds for all reads)
+	int min_seeds;					// The smallest seed limit of a read with seeds_per_kb
+	int seed_bins;					// Thin the seeds of a read by bins of its length (0: the rarest in the whole read)
 	int max_matches; 				// Maximum seed matches in a sketch
+	int match_budget;				// Maximum matches of a read over all its seeds (0: no limit)
 	double tThres; 					// The t-homology threshold
 	string paramsFile;
+	string outFile;					// Output sketch file (`sweepmap sketch`) or output prefix for multiple k
+	int threads;					// Threads for mapping the reads
+	double coarse;					// Density of the coarse sketch relative to hFrac for two-level mapping (0: off)
+	int chunk_len;					// Map reads longer than 1.5*chunk_len in overlapping chunks and stitch them (0: off)
+	int top;						// Output up to this many best reasonable mappings (0: all)
 
 	// no arguments
 	bool sam; 				// Output in SAM format (PAF by default)
@@ -40,18 +68,26 @@ struct params_t {
 	bool normalize; 		// Flag to save that scores are to be normalized
 	bool onlybest;			// Output up to one (best) mapping (if above the threshold)
 
+	bool sketch_only;		// `sweepmap sketch`: only sketch the queries to `outFile`
+	bool cpu_report;		// Print the detected CPU features and the selected kernels
+
 	params_t() :
-		k(15), hFrac(0.05), max_seeds(10000), max_matches(1000000), tThres(0.9),
-		sam(false), overlaps(false), normalize(false), onlybest(false) {}
+		k(15), hFrac(0.05), sampling(Sampling::FMH), max_seeds(10000), seeds_per_kb(0.0), min_seeds(100), seed_bins(0), max_matches(1000000), match_budget(0), tThres(0.9), threads(1), coarse(0.0), chunk_len(0), top(0),
+		sam(false), overlaps(false), normalize(false), onlybest(false), sketch_only(false), cpu_report(false) {}
 
 	void print(std::ostream& out, bool human) {
 		std::vector<pair<string, string>> m;
 		m.push_back({"pFile", pFile});
 		m.push_back({"tFile", tFile});
-		m.push_back({"k", std::to_string(k)});
+		m.push_back({"k", ks_str()});
 		m.push_back({"hFrac", std::to_string(hFrac)});
+		m.push_back({"sampling", sampling_name(sampling)});
 		m.push_back({"max_seeds", std::to_string(max_seeds)});
+		m.push_back({"seeds_per_kb", std::to_string(seeds_per_kb)});
+		m.push_back({"min_seeds", std::to_string(min_seeds)});
+		m.push_back({"seed_bins", std::to_string(seed_bins)});
 		m.push_back({"max_matches", std::to_string(max_matches)});
+		m.push_back({"match_budget", std::to_string(match_budget)});
 		m.push_back({"tThres", std::to_string(tThres)});
 		m.push_back({"paramsFile", paramsFile});
 
@@ -59,6 +95,10 @@ struct params_t {
 		m.push_back({"overlaps", std::to_string(overlaps)});
 		m.push_back({"normalize", std::to_string(normalize)});
 		m.push_back({"onlybest", std::to_string(onlybest)});
+		m.push_back({"threads", std::to_string(threads)});
+		m.push_back({"coarse", std::to_string(coarse)});
+		m.push_back({"chunk_len", std::to_string(chunk_len)});
+		m.push_back({"top", std::to_string(top)});
 
 		if (human) {
 			out << "Parameters:" << endl;
@@ -73,18 +113,50 @@ struct params_t {
 		}
 	}
 
+	// The s-mer length of the syncmers for kmer length `k` so that the
+	// density is ~hFrac: 1/w for open and 2/(w+1) for closed syncmers, w=k-s+1.
+	int syncmer_s(int k) const {
+		int w = sampling == Sampling::OPEN_SYNCMER ? int(std::round(1.0 / hFrac)) : int(std::round(2.0 / hFrac)) - 1;
+		if (sampling == Sampling::OPEN_SYNCMER && w % 2 == 0)
+			++w;  // the middle offset is the same on both strands only for odd w
+		return k - w + 1;
+	}
+
+	string ks_str() const {
+		if (ks.size() <= 1)
+			return std::to_string(k);
+		string res;
+		for (size_t i = 0; i < ks.size(); i++)
+			res += (i ? "," : "") + std::to_string(ks[i]);
+		return res;
+	}
+
 	void print_display(std::ostream& out) {
 		out << "Params:" << endl;
 		out << " | reference:             " << tFile << endl;
 		out << " | queries:               " << pFile << endl;
-		out << " | k:                     " << k << endl;
+		out << " | k:                     " << ks_str() << endl;
 		out << " | hFrac:                 " << hFrac << endl;
+		out << " | sampling:              " << sampling_name(sampling) << endl;
 		out << " | max_seeds (S):         " << max_seeds << endl;
+		if (seeds_per_kb > 0.0)
+			out << " | seeds_per_kb:          " << seeds_per_kb << " (limit in [" << min_seeds << "; " << max_seeds << "] per read)" << endl;
 		out << " | max_matches (M):       " << max_matches << endl;
+		if (seed_bins > 0)
+			out << " | seed_bins:             " << seed_bins << " (stratified thinning)" << endl;
+		if (match_budget > 0)
+			out << " | match_budget:          " << match_budget << " (per read)" << endl;
 		out << " | sam:                   " << sam << endl;
 		out << " | overlaps:              " << overlaps << endl;
 		out << " | onlybest:              " << onlybest << endl;
+		if (top > 0)
+			out << " | top:                   " << top << " (best reasonable mappings)" << endl;
 		out << " | tThres:                " << tThres << endl;
+		out << " | threads:               " << threads << endl;
+		if (coarse > 0.0)
+			out << " | coarse:                " << coarse << " (two-level mapping)" << endl;
+		if (chunk_len > 0)
+			out << " | chunk_len:             " << chunk_len << " (chunked mapping of longer reads)" << endl;
 	}
 
 };
@@ -93,25 +165,46 @@ inline void dsHlp() {
 	cerr << "sweep [-hn] [-p PATTERN_FILE] [-s TEXT_FILE] [-k KMER_LEN] [-r HASH_RATIO] [-b BLACKLIST] [-c COM_HASH_WGHT] [-u UNI\
 	_HASH_WGHT] [-t HOM_THRES] [-d DECENT] [-i INTERCEPT]" << endl;
 	cerr << endl;
+	cerr << "sweep sketch [-p PATTERN_FILE] [-O SKETCH_FILE] [-k KMER_LEN] [-r HASH_RATIO]" << endl;
+	cerr << endl;
 	cerr << "Find sketch-based pattern similarity in text." << endl;
+	cerr << "The `sketch` mode writes the pattern sketches to a file that can be passed to -p instead of a FASTA file." << endl;
 	cerr << endl;
 	cerr << "Required parameters:" << endl;
-	cerr << "   -p   --pattern           Pattern sequences file (FASTA format)" << endl;
+	cerr << "   -p   --pattern           Pattern sequences file (FASTA format or a sketch file)" << endl;
 	cerr << "   -s   --text              Text sequence file (FASTA format)" << endl;
 	cerr << endl;
 	cerr << "Optional parameters with an argument:" << endl;
-	cerr << "   -k   --ksize             K-mer length to be used for sketches" << endl;
+	cerr << "   -k   --ksize             K-mer length to be used for sketches; a comma-separated list (e.g. 14,16,18)" << endl;
+	cerr << "                            sketches and indexes all k in one pass and writes one output per k to PREFIX-K<k> (see -O)" << endl;
 	cerr << "   -r   --ratio   			 FracMinHash ratio in [0; 1] [0.1]" << endl;
+	cerr << "   -m   --sampling          Kmer sampling: fmh, open_syncmer or closed_syncmer [fmh]" << endl;
+	cerr << "                            (syncmers pick the s-mer length so that their density is ~ratio)" << endl;
 	cerr << "   -S   --max_seeds         Max seeds in a sketch" << endl;
+	cerr << "        --seeds_per_kb      Max seeds per kb of a read instead of a fixed -S, which becomes the ceiling [off]" << endl;
+	cerr << "        --min_seeds         The floor of the seed limit with --seeds_per_kb [100]" << endl;
+	cerr << "        --seed_bins         Thin the seeds by bins: split a read into this many bins of equal length and take" << endl;
+	cerr << "                            the rarest seeds of each bin under the same seed limit [0: the rarest of the whole read]" << endl;
 	cerr << "   -M   --max_matches       Max seed matches in a sketch" << endl;
+	cerr << "        --match_budget      Max matches of a read: its seeds are taken from the least frequent until their" << endl;
+	cerr << "                            matches would exceed the budget [no limit]" << endl;
 	cerr << "   -t   --hom_thres         Homology threshold" << endl;
 	cerr << "   -z   --params     		 Output file with parameters (tsv)" << endl;
+	cerr << "   -O   --output            Output sketch file (`sketch` mode), or output prefix for multiple k" << endl;
+	cerr << "   -T   --threads           Mapping threads (reading and writing run in two more threads); the output order is the same for any number [1]" << endl;
+	cerr << "        --coarse            Two-level mapping: find candidate regions with the seeds of hash below COARSE*ratio, then map" << endl;
+	cerr << "                            with all seeds only inside them; COARSE in (0; 1), fmh sampling only [off]" << endl;
+	cerr << "        --top               Output only the TOP reasonable mappings with the largest intersection [all]" << endl;
+	cerr << "        --chunk_len         Map reads longer than 1.5*CHUNK_LEN in overlapping chunks of CHUNK_LEN and stitch the" << endl;
+	cerr << "                            colinear chunk mappings into mappings of the whole read; the seed limit and the" << endl;
+	cerr << "                            match budget of a read are split among its chunks by length [off]" << endl;
 	cerr << endl;
 	cerr << "Optional parameters without an argument:" << endl;
 	cerr << "   -a                       Output in SAM format (PAF by default)" << endl;
 	cerr << "   -o   --overlaps          Permit overlapping mappings" << endl;
 	cerr << "   -n   --normalize         Normalize scores by length" << endl;
 	cerr << "   -x   --onlybest          Output the best alignment if above threshold (otherwise none)" << endl;
+	cerr << "        --cpu-report        Report the CPU features and the selected kernels (exits if no -p is given)" << endl;
 	cerr << "   -h   --help              Display this help message" << endl;
 }
 
@@ -122,13 +215,24 @@ bool prsArgs(int& nArgs, char** argList, params_t *params) {
         {"text",               required_argument,  0, 's'},
         {"ksize",              required_argument,  0, 'k'},
         {"hashratio",          required_argument,  0, 'r'},
+        {"sampling",           required_argument,  0, 'm'},
         {"max_seeds",          required_argument,  0, 'S'},
         {"max_matches",        required_argument,  0, 'M'},
         {"hom_thres",          required_argument,  0, 't'},
         {"params",             required_argument,  0, 'z'},
+        {"output",             required_argument,  0, 'O'},
+        {"threads",            required_argument,  0, 'T'},
         {"overlaps",           no_argument,        0, 'o'},
         {"normalize",          no_argument,        0, 'n'},
         {"onlybest",           no_argument,        0, 'x'},
+        {"coarse",             required_argument,  0, OPT_COARSE},
+        {"match_budget",       required_argument,  0, OPT_MATCH_BUDGET},
+        {"seeds_per_kb",       required_argument,  0, OPT_SEEDS_PER_KB},
+        {"min_seeds",          required_argument,  0, OPT_MIN_SEEDS},
+        {"seed_bins",          required_argument,  0, OPT_SEED_BINS},
+        {"chunk_len",          required_argument,  0, OPT_CHUNK_LEN},
+        {"top",                required_argument,  0, OPT_TOP},
+        {"cpu-report",         no_argument,        0, OPT_CPU_REPORT},
         {"help",               no_argument,        0, 'h'},
         {0,                    0,                  0,  0 }
     };
@@ -142,13 +246,24 @@ bool prsArgs(int& nArgs, char** argList, params_t *params) {
 			case 's':
 				params->tFile = optarg;
 				break;
-			case 'k':
-				if(atoi(optarg) <= 0) {
+			case 'k': {
+				params->ks.clear();
+				std::stringstream ss(optarg);
+				string k_str;
+				while (std::getline(ss, k_str, ',')) {
+					if(atoi(k_str.c_str()) <= 0) {
+						cerr << "ERROR: K-mer length " << k_str << " not applicable" << endl;
+						return false;
+					}
+					params->ks.push_back(atoi(k_str.c_str()));
+				}
+				if (params->ks.empty()) {
 					cerr << "ERROR: K-mer length not applicable" << endl;
 					return false;
 				}
-				params->k = atoi(optarg);
+				params->k = params->ks[0];
 				break;
+			}
 			case 'r':
 				if(atof(optarg) <= 0 || atof(optarg) > 1.0) {
 					cerr << "ERROR: Given hash ratio " << optarg << " not applicable" << endl;
@@ -156,6 +271,18 @@ bool prsArgs(int& nArgs, char** argList, params_t *params) {
 				}
 				params->hFrac = atof(optarg);
 				break;
+			case 'm':
+				if (string(optarg) == "fmh")
+					params->sampling = Sampling::FMH;
+				else if (string(optarg) == "open_syncmer")
+					params->sampling = Sampling::OPEN_SYNCMER;
+				else if (string(optarg) == "closed_syncmer")
+					params->sampling = Sampling::CLOSED_SYNCMER;
+				else {
+					cerr << "ERROR: Unknown sampling scheme " << optarg << endl;
+					return false;
+				}
+				break;
 			case 'S':
 				if(atoi(optarg) <= 0) {
 					cerr << "ERROR: The number of seeds should be positive." << endl;
@@ -176,6 +303,16 @@ bool prsArgs(int& nArgs, char** argList, params_t *params) {
 			case 'z':
 				params->paramsFile = optarg;
 				break;
+			case 'O':
+				params->outFile = optarg;
+				break;
+			case 'T':
+				if(atoi(optarg) <= 0) {
+					cerr << "ERROR: The number of threads should be positive." << endl;
+					return false;
+				}
+				params->threads = atoi(optarg);
+				break;
 			case 'a':
 				params->sam = true;
 				break;
@@ -188,6 +325,58 @@ bool prsArgs(int& nArgs, char** argList, params_t *params) {
 			case 'x':
 				params->onlybest = true;
 				break;
+			case OPT_COARSE:
+				if(atof(optarg) <= 0.0 || atof(optarg) >= 1.0) {
+					cerr << "ERROR: The coarse density " << optarg << " should be in (0; 1)." << endl;
+					return false;
+				}
+				params->coarse = atof(optarg);
+				break;
+			case OPT_MATCH_BUDGET:
+				if(atoi(optarg) <= 0) {
+					cerr << "ERROR: The match budget should be positive." << endl;
+					return false;
+				}
+				params->match_budget = atoi(optarg);
+				break;
+			case OPT_SEEDS_PER_KB:
+				if(atof(optarg) <= 0.0) {
+					cerr << "ERROR: The seeds per kb should be positive." << endl;
+					return false;
+				}
+				params->seeds_per_kb = atof(optarg);
+				break;
+			case OPT_MIN_SEEDS:
+				if(atoi(optarg) <= 0) {
+					cerr << "ERROR: The minimal number of seeds should be positive." << endl;
+					return false;
+				}
+				params->min_seeds = atoi(optarg);
+				break;
+			case OPT_SEED_BINS:
+				if(atoi(optarg) <= 0) {
+					cerr << "ERROR: The number of seed bins should be positive." << endl;
+					return false;
+				}
+				params->seed_bins = atoi(optarg);
+				break;
+			case OPT_CHUNK_LEN:
+				if(atoi(optarg) <= 0) {
+					cerr << "ERROR: The chunk length should be positive." << endl;
+					return false;
+				}
+				params->chunk_len = atoi(optarg);
+				break;
+			case OPT_TOP:
+				if(atoi(optarg) <= 0) {
+					cerr << "ERROR: The number of top mappings should be positive." << endl;
+					return false;
+				}
+				params->top = atoi(optarg);
+				break;
+			case OPT_CPU_REPORT:
+				params->cpu_report = true;
+				break;
 			case 'h':
 				return false;
 			default:
@@ -196,11 +385,52 @@ bool prsArgs(int& nArgs, char** argList, params_t *params) {
 		}
 	}
 
+	if (params->ks.empty())
+		params->ks = {params->k};
+	if (params->cpu_report && params->pFile.empty())
+		return true;
+	if (params->sampling != Sampling::FMH) {
+		for (int k: params->ks) {
+			if (params->syncmer_s(k) < 3) {
+				cerr << "ERROR: Syncmers with density " << params->hFrac << " need s-mers of length " << params->syncmer_s(k)
+					 << " for k=" << k << "; increase -k or -r." << endl;
+				return false;
+			}
+		}
+	}
+	if (params->seeds_per_kb > 0.0 && params->min_seeds > params->max_seeds) {
+		cerr << "ERROR: The seed limit floor --min_seeds " << params->min_seeds << " is above the ceiling -S " << params->max_seeds << "." << endl;
+		return false;
+	}
+	if (params->top > 0 && (params->onlybest || params->overlaps)) {
+		cerr << "ERROR: --top selects among the reasonable mappings and cannot be combined with -x or -o." << endl;
+		return false;
+	}
+	if (params->chunk_len > 0 && params->chunk_len <= 10 * params->k) {
+		cerr << "ERROR: The chunk length " << params->chunk_len << " should be much longer than k." << endl;
+		return false;
+	}
+	if (params->coarse > 0.0 && params->sampling != Sampling::FMH) {
+		cerr << "ERROR: Two-level mapping (--coarse) needs nested sketches, i.e. fmh sampling." << endl;
+		return false;
+	}
+	if (params->ks.size() > 1 && params->outFile.empty()) {
+		cerr << "ERROR: Multiple kmer lengths need an output prefix (-O)." << endl;
+		return false;
+	}
+	if (params->sketch_only)
+		return !params->pFile.empty() && !params->outFile.empty();
 	return !params->pFile.empty() && !params->tFile.empty();
 }
 
 KSEQ_INIT(gzFile, gzread)  
 
+// A query read, owning its name and sequence (kseq_t reuses its buffers).
+struct Read {
+	string name;
+	string seq;
+};
+
 // seq->name.s, seq->comment.l, seq->comment.s, seq->seq.s, seq->qual.l
 void read_fasta_klib(const std::string& filename, std::function<void(kseq_t*)> callback) {
     gzFile fp = gzopen(filename.c_str(), "r");
@@ -215,4 +445,23 @@ void read_fasta_klib(const std::string& filename, std::function<void(kseq_t*)> c
     gzclose(fp);
 }
 
+// Reads the sequences in batches and calls `callback` for each batch. A
+// batch ends after `batch_size` sequences or `batch_len` nucleotides.
+void read_fasta_batches(const std::string& filename, size_t batch_size, size_t batch_len, std::function<void(std::vector<Read>&)> callback) {
+	std::vector<Read> batch;
+	size_t len = 0;
+	batch.reserve(batch_size);
+	read_fasta_klib(filename, [&](kseq_t *seq) {
+		batch.push_back(Read{seq->name.s, string(seq->seq.s, seq->seq.l)});
+		len += seq->seq.l;
+		if (batch.size() == batch_size || len >= batch_len) {
+			callback(batch);
+			batch.clear();
+			len = 0;
+		}
+	});
+	if (!batch.empty())
+		callback(batch);
+}
+
 } // namespace sweepmap
\ No newline at end of file
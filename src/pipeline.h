@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+#include "utils.h"
+
+namespace sweepmap {
+
+// BoundedQueue -- a fixed-capacity multi-producer multi-consumer queue that
+// connects the stages of the mapping pipeline (reader -> mappers -> writer).
+// Lock-free ring of slots with sequence numbers (D. Vyukov's bounded MPMC
+// queue): a producer claims the slot at `tail` with a CAS once the slot is
+// free for its round, a consumer claims the slot at `head` once it is filled.
+// A full queue blocks the producers, which bounds the memory in flight, and
+// an empty one blocks the consumers. The blocked threads sleep on the
+// counters of pops and pushes (std::atomic::wait) until the other side
+// makes progress.
+template<typename V>
+class BoundedQueue {
+	struct Slot {
+		std::atomic<size_t> seq;
+		V value;
+	};
+
+	std::unique_ptr<Slot[]> slots;
+	const size_t mask;
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) std::atomic<size_t> tail;
+	alignas(64) std::atomic<bool> closed;
+	alignas(64) std::atomic<size_t> pushes;  // bumped after every push and on close()
+	alignas(64) std::atomic<size_t> pops;    // bumped after every pop
+
+	static size_t round_up_pow2(size_t n) {
+		size_t p = 2;
+		while (p < n) p *= 2;
+		return p;
+	}
+
+public:
+	// The capacity is rounded up to a power of two.
+	explicit BoundedQueue(size_t capacity)
+		: slots(new Slot[round_up_pow2(capacity)]), mask(round_up_pow2(capacity) - 1), head(0), tail(0), closed(false), pushes(0), pops(0) {
+		for (size_t i = 0; i <= mask; i++)
+			slots[i].seq.store(i, std::memory_order_relaxed);
+	}
+
+	bool try_push(V &v) {
+		size_t pos = tail.load(std::memory_order_relaxed);
+		while (true) {
+			Slot &slot = slots[pos & mask];
+			const size_t seq = slot.seq.load(std::memory_order_acquire);
+			if (seq == pos) {
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					slot.value = std::move(v);
+					slot.seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (seq < pos) {
+				return false;  // full
+			} else {
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool try_pop(V &v) {
+		size_t pos = head.load(std::memory_order_relaxed);
+		while (true) {
+			Slot &slot = slots[pos & mask];
+			const size_t seq = slot.seq.load(std::memory_order_acquire);
+			if (seq == pos + 1) {
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					v = std::move(slot.value);
+					slot.seq.store(pos + mask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (seq < pos + 1) {
+				return false;  // empty
+			} else {
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Blocks while the queue is full; the blocked time goes to `waiting`.
+	void push(V v, Timer *waiting) {
+		if (!try_push(v)) {
+			waiting->start();
+			while (true) {
+				// A pop after reading `seen` wakes the wait up.
+				const size_t seen = pops.load();
+				if (try_push(v))
+					break;
+				pops.wait(seen);
+			}
+			waiting->stop();
+		}
+		pushes.fetch_add(1);
+		pushes.notify_all();
+	}
+
+	// Blocks while the queue is empty and not closed; the blocked time goes
+	// to `waiting`. Returns false when the queue is closed and drained.
+	bool pop(V *v, Timer *waiting) {
+		bool popped = try_pop(*v);
+		if (!popped) {
+			waiting->start();
+			while (true) {
+				const size_t seen = pushes.load();
+				if ((popped = try_pop(*v)))
+					break;
+				if (closed.load(std::memory_order_acquire)) {
+					popped = try_pop(*v);  // pushed before closing
+					break;
+				}
+				pushes.wait(seen);
+			}
+			waiting->stop();
+		}
+		if (popped) {
+			pops.fetch_add(1);
+			pops.notify_all();
+		}
+		return popped;
+	}
+
+	// No more pushes; the consumers stop once the queue is drained.
+	void close() {
+		closed.store(true, std::memory_order_release);
+		pushes.fetch_add(1);
+		pushes.notify_all();
+	}
+};
+
+} // namespace sweepmap
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace sweepmap {
+
+// LSD radix sort of records by a 64-bit key in 8-bit digits. Only the
+// digits in which some keys differ are sorted by, e.g. 4 or 5 of them for
+// the (segment, position) keys of the matches. Stable; O(n) per digit.
+// `buf` is scratch space for `n` < 2^32 records. The records are moved
+// with memcpy, so they have to be trivially copyable.
+template<typename Rec, typename KeyFn>
+void radix_sort(Rec *a, Rec *buf, size_t n, KeyFn key) {
+	static_assert(std::is_trivially_copyable_v<Rec>);
+	constexpr int RADIX_BITS = 8;
+	constexpr int BUCKETS = 1 << RADIX_BITS;
+	constexpr int DIGITS = 64 / RADIX_BITS;
+
+	if (n < 2)
+		return;
+
+	// the bits that are not the same in all keys
+	uint64_t all_or = 0, all_and = ~uint64_t(0);
+	for (size_t i = 0; i < n; i++) {
+		const uint64_t k = key(a[i]);
+		all_or |= k;
+		all_and &= k;
+	}
+	const uint64_t varying = all_or ^ all_and;
+
+	int digits[DIGITS], passes = 0;
+	for (int d = 0; d < DIGITS; d++)
+		if ((varying >> (d * RADIX_BITS)) & (BUCKETS - 1))
+			digits[passes++] = d;
+
+	// the histograms of all passes in one read of the keys
+	uint32_t cnt[DIGITS][BUCKETS];
+	std::memset(cnt, 0, sizeof(uint32_t) * BUCKETS * passes);
+	for (size_t i = 0; i < n; i++) {
+		const uint64_t k = key(a[i]);
+		for (int p = 0; p < passes; p++)
+			++cnt[p][(k >> (digits[p] * RADIX_BITS)) & (BUCKETS - 1)];
+	}
+
+	Rec *src = a, *dst = buf;
+	for (int p = 0; p < passes; p++) {
+		const int shift = digits[p] * RADIX_BITS;
+		uint32_t pos[BUCKETS], sum = 0;
+		for (int b = 0; b < BUCKETS; b++) {
+			pos[b] = sum;
+			sum += cnt[p][b];
+		}
+		for (size_t i = 0; i < n; i++)
+			std::memcpy(&dst[pos[(key(src[i]) >> shift) & (BUCKETS - 1)]++], &src[i], sizeof(Rec));
+		std::swap(src, dst);
+	}
+	if (src != a)
+		std::memcpy(a, src, n * sizeof(Rec));
+}
+
+} // namespace sweepmap
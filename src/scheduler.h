@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "utils.h"
+
+namespace sweepmap {
+
+// TaskPool -- a work-stealing thread pool. Every worker has its own deques
+// of tasks and steals from the deques of the other workers when its own are
+// empty. There are two kinds of tasks:
+//  * jobs, submitted with `submit`, e.g. mapping a chunk of reads; a job
+//    runs on one worker and may use the state of that worker (worker_id()).
+//    Jobs are taken oldest first, also from the own deque, so that the
+//    ordered output is not held back by an old job.
+//  * subtasks, created by `parallel_for` inside a job for the pieces of a
+//    long read; they must not use worker state. The owner takes its newest
+//    subtask (cache-warm) and thieves the oldest. A worker that waits for
+//    its subtasks runs other subtasks (never jobs) meanwhile.
+class TaskPool {
+	using task_t = std::function<void()>;
+
+	struct Deques {
+		std::mutex m;
+		std::deque<task_t> jobs, subtasks;
+	};
+
+	std::vector<std::unique_ptr<Deques>> deques;
+	std::vector<std::thread> threads;
+	std::vector<Timer> busy;				// per worker
+	std::atomic<size_t> queued;				// tasks in the deques
+	std::atomic<size_t> unfinished_jobs;
+	std::atomic<size_t> next_deque;			// for jobs submitted from outside the pool
+	std::atomic<size_t> steals;
+	std::atomic<bool> stopping;
+	std::mutex sleep_m;
+	std::condition_variable sleep_cv;
+
+	inline static thread_local int worker = -1;
+
+	void push(task_t task, bool is_job) {
+		const size_t w = worker >= 0 ? worker : next_deque++ % deques.size();
+		{
+			std::lock_guard<std::mutex> lock(deques[w]->m);
+			(is_job ? deques[w]->jobs : deques[w]->subtasks).push_back(std::move(task));
+		}
+		{
+			// under the lock, so a worker that found no task is either not yet
+			// checking or already waiting for the notification
+			std::lock_guard<std::mutex> lock(sleep_m);
+			++queued;
+		}
+		sleep_cv.notify_one();
+	}
+
+	// Takes a task for worker `w`: from its own deques or else the oldest one of another worker.
+	bool take(int w, bool jobs, task_t *task) {
+		const int n = deques.size();
+		for (int i = 0; i < n; i++) {
+			Deques &d = *deques[(w + i) % n];
+			std::lock_guard<std::mutex> lock(d.m);
+			auto &q = jobs ? d.jobs : d.subtasks;
+			if (q.empty())
+				continue;
+			if (i == 0 && !jobs) {
+				*task = std::move(q.back());
+				q.pop_back();
+			} else {
+				*task = std::move(q.front());
+				q.pop_front();
+			}
+			if (i > 0)
+				++steals;
+			--queued;
+			return true;
+		}
+		return false;
+	}
+
+	// Runs one task; subtasks first since a job is waiting for them.
+	bool run_one(bool jobs) {
+		task_t task;
+		const int w = std::max(worker, 0);
+		if (take(w, false, &task) || (jobs && take(w, true, &task))) {
+			task();
+			return true;
+		}
+		return false;
+	}
+
+	void worker_loop(int w, const std::function<void(int)> &on_start) {
+		worker = w;
+		on_start(w);
+		while (!stopping) {
+			busy[w].start();
+			const bool ran = run_one(true);
+			busy[w].stop();
+			if (!ran) {
+				std::unique_lock<std::mutex> lock(sleep_m);
+				sleep_cv.wait(lock, [&] { return queued > 0 || stopping; });
+			}
+		}
+	}
+
+public:
+	// Starts `n` workers; each calls `on_start(worker_id)` first.
+	TaskPool(int n, const std::function<void(int)> &on_start)
+		: busy(n), queued(0), unfinished_jobs(0), next_deque(0), steals(0), stopping(false) {
+		for (int w = 0; w < n; w++)
+			deques.emplace_back(new Deques());
+		for (int w = 0; w < n; w++)
+			threads.emplace_back([this, w, on_start] { worker_loop(w, on_start); });
+	}
+
+	~TaskPool() {
+		stop();
+	}
+
+	// Stops and joins the workers; the queued tasks are dropped.
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(sleep_m);
+			stopping = true;
+		}
+		sleep_cv.notify_all();
+		for (auto &thread: threads)
+			if (thread.joinable())
+				thread.join();
+	}
+
+	int size() const { return deques.size(); }
+
+	// The worker running the current task; -1 outside of the pool.
+	static int worker_id() { return worker; }
+
+	void submit(task_t job) {
+		++unfinished_jobs;
+		push([this, job = std::move(job)] {
+			job();
+			if (--unfinished_jobs == 0)
+				unfinished_jobs.notify_all();
+		}, true);
+	}
+
+	// Waits until all submitted jobs have finished.
+	void wait() {
+		for (size_t n; (n = unfinished_jobs.load()) > 0; )
+			unfinished_jobs.wait(n);
+	}
+
+	// Calls fn(i) for all i in [0, n) in parallel and returns when all calls
+	// have finished. The calling worker runs fn(0) and helps with subtasks;
+	// when there are none left to run, it sleeps until the last one of its
+	// own finishes. The counter is shared, as the last subtask notifies
+	// after the caller may have returned.
+	void parallel_for(size_t n, const std::function<void(size_t)> &fn) {
+		auto left = std::make_shared<std::atomic<size_t>>(n);
+		for (size_t i = 1; i < n; i++)
+			push([&fn, left, i] {
+				fn(i);
+				if (--*left == 0)
+					left->notify_all();
+			}, false);
+		if (n > 0) {
+			fn(0);
+			--*left;
+		}
+		for (size_t m; (m = left->load()) > 0; )
+			if (!run_one(false))
+				left->wait(m);
+	}
+
+	// The time the workers spent running tasks (after stop()).
+	double busy_secs() const {
+		double secs = 0.0;
+		for (const auto &t: busy)
+			secs += t.secs();
+		return secs;
+	}
+
+	size_t stolen() const { return steals; }
+};
+
+} // namespace sweepmap
@@ -1,11 +1,18 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <climits>
+#include <cstring>
 #include <iostream>
+#include <numeric>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "cpu.h"
 #include "io.h"
+#include "scheduler.h"
 #include "utils.h"
 
 namespace sweepmap {
@@ -18,14 +25,19 @@ struct Kmer {
 	Kmer(pos_t r, hash_t h, bool strand) : r(r), h(h), strand(strand) {}
 };
 
+// SIMD vector of L hashes and L packed nucleotide codes (see buildFMHSketchLanes)
+template<int L> struct simd;
+template<> struct simd<8> { using vec = hash_t __attribute__((vector_size(8 * sizeof(hash_t)))); using codes = uint64_t; };
+
 class Sketch {
 public:
 	using sketch_t = std::vector<Kmer>;
 
 	inline static hash_t LUT_fw[256], LUT_rc[256];
 	inline static params_t *params;
-	inline static Timers *T;
-	inline static Counters *C;
+	// Per thread, so that mapping threads count into their own Counters.
+	inline static thread_local Timers *T;
+	inline static thread_local Counters *C;
 
 	static void initialize_LUT() {
 		// https://gist.github.com/Daniel-Liu-c0deb0t/7078ebca04569068f15507aa856be6e8
@@ -44,8 +56,8 @@ public:
 
 private:
 	// TODO: use either only forward or only reverse
-	// TODO: accept char*
-	const sketch_t buildFMHSketch(const std::string& s, int k, double hFrac) {
+	MULTIVERSION
+	static sketch_t buildFMHSketch(std::string_view s, int k, double hFrac) {
 		sketch_t kmers;
 		kmers.reserve((int)(1.1 * (double)s.size() * hFrac));
 
@@ -81,17 +93,380 @@ private:
 		return kmers;
 	}
 
+	// FracMinHash of up to L sequences at once, one sequence per SIMD lane:
+	// the rolling hashes of all lanes advance together and the lanes of
+	// sequences that already ended are masked out. The sketches are identical
+	// to buildFMHSketch.
+	template<int L>
+	using hash_v = typename simd<L>::vec;
+
+	// Lanes per batch: 8 with 512-bit vectors. With narrower vectors the
+	// lookups and the candidate extraction cost more than they save, so
+	// without AVX-512 batches are sketched one sequence at a time.
+	static constexpr int LANES = 8;
+
+	// Vectors are passed by reference: portable builds compile these helpers
+	// without AVX-512, where passing 512-bit vectors by value changes the ABI.
+
+	// ORs all lanes of `m` into every lane with log2(L) butterfly shuffles.
+	template<int L, int STEP = L/2>
+	static inline void or_lanes(hash_v<L> &m) {
+		if constexpr (STEP > 0) {
+			hash_v<L> idx;
+			for (int l = 0; l < L; l++)
+				idx[l] = l ^ STEP;
+			m |= __builtin_shuffle(m, idx);
+			or_lanes<L, STEP/2>(m);
+		}
+	}
+
+	// The L lowest bits of `mask`, one per lane with a nonzero value.
+	template<int L>
+	static inline unsigned lane_mask(const hash_v<L> &mask) {
+		hash_v<L> bits;
+		for (int l = 0; l < L; l++)
+			bits[l] = hash_t(1) << l;
+		bits &= mask;
+		or_lanes<L>(bits);
+		return unsigned(bits[0]);
+	}
+
+	template<int L>
+	static void buildFMHSketchLanes(const std::string_view *seqs, int lanes, int k, double hFrac, sketch_t *sketches) {
+		using vec = hash_v<L>;
+		using codes_t = typename simd<L>::codes;
+		static const auto code = [] {
+			std::array<uint8_t, 256> code;
+			code.fill(4);
+			code['A'] = code['a'] = 0, code['C'] = code['c'] = 1, code['G'] = code['g'] = 2, code['T'] = code['t'] = 3;
+			return code;
+		}();
+		const hash_t hThres = hash_t(hFrac * double(std::numeric_limits<hash_t>::max()));
+
+		int max_len = 0;
+		vec len_v = {};
+		for (int l = 0; l < lanes; l++) {
+			const int len = seqs[l].size();
+			len_v[l] = hash_t(len < k ? 0 : len);   // lanes with r > len are inactive
+			max_len = std::max(max_len, len);
+			sketches[l].reserve((int)(1.1 * (double)len * hFrac));
+		}
+		if (max_len < k) return;
+
+		// Transposed nucleotide codes (A=0, C=1, G=2, T=3, other=4): the codes
+		// of all lanes at position r are consecutive. Positions after the end of
+		// a sequence are padded with A.
+		std::vector<uint8_t> codes((size_t)max_len * L, 0);
+		for (int l = 0; l < lanes; l++)
+			for (int r = 0; r < (int)seqs[l].size(); r++)
+				codes[(size_t)r * L + l] = code[(uint8_t)seqs[l][r]];
+		vec code_shift;
+		for (int l = 0; l < L; l++)
+			code_shift[l] = 8*l;
+		auto codes_at = [&](int r, vec &out) {
+			codes_t c;
+			std::memcpy(&c, &codes[(size_t)r * L], sizeof(c));
+			out = ((vec{} + c) >> code_shift) & 0xff;
+		};
+
+		// LUT values (pre-rotated as in the rolling update) looked up for all
+		// lanes at once by shuffling with the nucleotide codes (other: 0).
+		auto table = [](vec &t, const hash_t *lut, int rot) {
+			t = vec{};
+			t[0] = std::rotl(lut['A'], rot), t[1] = std::rotl(lut['C'], rot), t[2] = std::rotl(lut['G'], rot), t[3] = std::rotl(lut['T'], rot);
+		};
+		vec in_fw, out_fw, in_rc, out_rc;
+		table(in_fw, LUT_fw, 0), table(out_fw, LUT_fw, k);
+		table(in_rc, LUT_rc, k-1), table(out_rc, LUT_rc, -1);
+
+		vec h_fw = {}, h_rc = {};
+		for (int l = 0; l < lanes; l++) {
+			for (int r = 0; r < std::min(k, (int)seqs[l].size()); r++) {
+				h_fw[l] ^= std::rotl(LUT_fw[(int)seqs[l][r]], k-r-1);
+				h_rc[l] ^= std::rotl(LUT_rc[(int)seqs[l][r]], r);
+			}
+		}
+
+		// Sampled kmers are appended branch-free to per-lane blocks of up to
+		// BLOCK kmers, which are flushed to the sketches when full.
+		constexpr int BLOCK = 1024;
+		thread_local std::vector<Kmer> block(L * BLOCK, Kmer(0, 0, false));
+		int block_sz[L] = {};
+		auto flush = [&] {
+			for (int l = 0; l < lanes; l++) {
+				sketches[l].insert(sketches[l].end(), block.begin() + l*BLOCK, block.begin() + l*BLOCK + block_sz[l]);
+				block_sz[l] = 0;
+			}
+		};
+
+		const vec rare = (vec{} + 1) << 31;
+		for (int r = k, steps = 0; ; r++) {
+			// Same canonical strand rule as buildFMHSketch: the lowest differing
+			// bit decides. Lanes whose lowest differing bit is bit 31 or higher
+			// (or with equal hashes) are rare and recomputed with the scalar rule.
+			const vec diff    = h_fw ^ h_rc;
+			const vec lowbit  = diff & -diff;
+			const vec strand  = (h_fw & lowbit) != 0;
+			const vec h       = strand ? h_rc : h_fw;
+			const vec active  = vec{} + hash_t(r) <= len_v;
+			const vec is_rare = active & (lowbit - 1 >= rare - 1);
+			const vec sampled = active & ~is_rare & (h < hThres);
+
+			if (lane_mask<L>(sampled | is_rare)) {
+				for (int l = 0; l < lanes; l++) {
+					block[l*BLOCK + block_sz[l]] = Kmer(r, h[l], strand[l]);
+					block_sz[l] += sampled[l] & 1;
+				}
+			}
+			for (unsigned mask = lane_mask<L>(is_rare); mask; mask &= mask - 1) {
+				const int l = std::countr_zero(mask);
+				const auto first_diff_bit = 1 << std::countr_zero(h_fw[l] ^ h_rc[l]);
+				const bool strand_l       = h_fw[l] & first_diff_bit;
+				const hash_t h_l          = strand_l ? h_rc[l] : h_fw[l];
+				if (h_l < hThres)
+					block[l*BLOCK + block_sz[l]++] = Kmer(r, h_l, strand_l);
+			}
+
+			if (r >= max_len) break;
+			if (++steps == BLOCK - 1) {
+				flush();
+				steps = 0;
+			}
+
+			vec c_in, c_out;
+			codes_at(r, c_in), codes_at(r-k, c_out);
+			h_fw = ((h_fw << 1) | (h_fw >> 63)) ^ __builtin_shuffle(out_fw, c_out) ^ __builtin_shuffle(in_fw, c_in);
+			h_rc = ((h_rc >> 1) | (h_rc << 63)) ^ __builtin_shuffle(out_rc, c_out) ^ __builtin_shuffle(in_rc, c_in);
+		}
+		flush();
+	}
+
+	// The batch kernel compiled for AVX-512 regardless of -march; called only
+	// if the CPU supports it.
+	TARGET_AVX512
+	static void buildFMHSketchLanes_avx512(const std::string_view *seqs, int lanes, int k, double hFrac, sketch_t *sketches) {
+		buildFMHSketchLanes<LANES>(seqs, lanes, k, hFrac, sketches);
+	}
+
+	// Syncmer sampling: a kmer is sampled depending only on the position of
+	// its smallest s-mer among its w = k-s+1 s-mers (canonical s-mer hashes).
+	//  * open syncmers: the smallest s-mer is in the middle (w is odd so that
+	//    the rule is the same on both strands); density 1/w and a more even
+	//    spacing than random sampling.
+	//  * closed syncmers: the smallest s-mer is first or last; density
+	//    ~2/(w+1) with a window guarantee: at least one sampled kmer among
+	//    any w consecutive kmers.
+	// The sampled kmers carry the same hash and strand as with FracMinHash.
+	MULTIVERSION
+	static sketch_t buildSyncmerSketch(std::string_view s, int k, int smer, Sampling sampling) {
+		sketch_t kmers;
+		const int n = s.size();
+		const int w = k - smer + 1;
+		assert(1 <= smer && smer <= k);
+		kmers.reserve((int)(1.1 * (double)n / double(sampling == Sampling::OPEN_SYNCMER ? w : (w+1)/2)));
+		if (n < k) return kmers;
+
+		hash_t h_fw = 0, h_rc = 0, s_fw = 0, s_rc = 0;
+		for (int r = 0; r < smer; r++) {
+			s_fw ^= std::rotl(LUT_fw[(int)s[r]], smer-r-1);
+			s_rc ^= std::rotl(LUT_rc[(int)s[r]], r);
+		}
+		for (int r = 0; r < k; r++) {
+			h_fw ^= std::rotl(LUT_fw[(int)s[r]], k-r-1);
+			h_rc ^= std::rotl(LUT_rc[(int)s[r]], r);
+		}
+
+		// The last w canonical s-mer hashes by their right end, and a monotone
+		// queue of (s-mer right end, hash) with increasing hashes whose front
+		// is the smallest s-mer in the current kmer.
+		std::vector<hash_t> smers(w);
+		std::vector<std::pair<int, hash_t>> q(w+1);
+		int q_head = 0, q_size = 0;
+		auto q_at = [&](int i) -> std::pair<int, hash_t>& { return q[(q_head + i) % (w+1)]; };
+
+		// e is the right end of the s-mer [e-s, e), which is the last s-mer of the kmer [e-k, e)
+		for (int e = smer; e <= n; e++) {
+			if (e > smer) {
+				const int in = (int)s[e-1], out = (int)s[e-1-smer];
+				s_fw = std::rotl(s_fw, 1) ^ std::rotl(LUT_fw[out], smer) ^ LUT_fw[in];
+				s_rc = std::rotr(s_rc, 1) ^ std::rotr(LUT_rc[out], 1) ^ std::rotl(LUT_rc[in], smer-1);
+			}
+			const hash_t sh = std::min(s_fw, s_rc);
+			smers[e % w] = sh;
+			while (q_size > 0 && q_at(q_size-1).second > sh)
+				--q_size;
+			q_at(q_size++) = {e, sh};
+
+			if (e < k) continue;
+			if (e > k) {
+				const int in = (int)s[e-1], out = (int)s[e-1-k];
+				h_fw = std::rotl(h_fw, 1) ^ std::rotl(LUT_fw[out], k) ^ LUT_fw[in];
+				h_rc = std::rotr(h_rc, 1) ^ std::rotr(LUT_rc[out], 1) ^ std::rotl(LUT_rc[in], k-1);
+			}
+			const int first_e = e - k + smer;
+			while (q_at(0).first < first_e)
+				q_head = (q_head + 1) % (w+1), --q_size;
+
+			// Comparing hashes rather than positions keeps ties strand-symmetric.
+			const hash_t min_sh = q_at(0).second;
+			const bool sampled = sampling == Sampling::OPEN_SYNCMER
+				? smers[(first_e + (w-1)/2) % w] == min_sh
+				: smers[first_e % w] == min_sh || sh == min_sh;
+			if (sampled) {
+				const auto first_diff_bit = 1 << std::countr_zero(h_fw ^ h_rc);
+				const bool strand         = h_fw & first_diff_bit;
+				kmers.push_back(Kmer(e, strand ? h_rc : h_fw, strand));
+			}
+		}
+
+		return kmers;
+	}
+
+	static sketch_t buildSketch(std::string_view s, int k, double hFrac) {
+		if (params->sampling == Sampling::FMH)
+			return buildFMHSketch(s, k, hFrac);
+		return buildSyncmerSketch(s, k, params->syncmer_s(k), params->sampling);
+	}
+
 public:
+	// Sketches `s` for all kmer lengths `ks` in a single pass over the
+	// sequence by maintaining one pair of rolling hashes per k. The i-th
+	// sketch is identical to buildFMHSketch(s, ks[i], hFrac).
+	MULTIVERSION
+	static std::vector<sketch_t> buildFMHSketches(const std::string& s, const std::vector<int> &ks, double hFrac) {
+		const int K = ks.size();
+		const int n = s.size();
+		std::vector<sketch_t> sketches(K);
+		std::vector<hash_t> h_fw(K, 0), h_rc(K, 0);
+		hash_t hThres = hash_t(hFrac * double(std::numeric_limits<hash_t>::max()));
+
+		int min_k = std::numeric_limits<int>::max();
+		for (int i = 0; i < K; i++) {
+			const int k = ks[i];
+			sketches[i].reserve((int)(1.1 * (double)s.size() * hFrac));
+			min_k = std::min(min_k, k);
+			if (n < k) continue;
+			for (int r = 0; r < k; r++) {
+				h_fw[i] ^= std::rotl(LUT_fw[(int)s[r]], k-r-1);
+				h_rc[i] ^= std::rotl(LUT_rc[(int)s[r]], r);
+			}
+		}
+
+		// r is the right end of the kmers [r-k, r) for all k
+		for (int r = min_k; r <= n; r++) {
+			const int in = (int)s[r-1];
+			for (int i = 0; i < K; i++) {
+				const int k = ks[i];
+				if (r < k) continue;
+				if (r > k) {
+					const int out = (int)s[r-1-k];
+					h_fw[i] = std::rotl(h_fw[i], 1) ^ std::rotl(LUT_fw[out], k) ^ LUT_fw[in];
+					h_rc[i] = std::rotr(h_rc[i], 1) ^ std::rotr(LUT_rc[out], 1) ^ std::rotl(LUT_rc[in], k-1);
+				}
+				const auto first_diff_bit = 1 << std::countr_zero(h_fw[i] ^ h_rc[i]);
+				const bool strand         = h_fw[i] & first_diff_bit;
+				const hash_t h            = strand ? h_rc[i] : h_fw[i];
+				if (h < hThres)
+					sketches[i].push_back(Kmer(r, h, strand));
+			}
+		}
+
+		return sketches;
+	}
+
+	// Sketches `s` for all kmer lengths `ks` with the sampling scheme of the
+	// run. FracMinHash takes a single pass for all k.
+	static std::vector<sketch_t> buildSketches(const std::string& s, const std::vector<int> &ks, double hFrac) {
+		std::vector<sketch_t> sketches;
+		if (params->sampling == Sampling::FMH) {
+			sketches = buildFMHSketches(s, ks, hFrac);
+		} else {
+			for (int k: ks)
+				sketches.push_back(buildSyncmerSketch(s, k, params->syncmer_s(k), params->sampling));
+		}
+
+		C->inc("sketched_seqs");
+		C->inc("sketched_len", s.size());
+		for (const auto &sk: sketches) {
+			C->inc("original_kmers", sk.size());
+			C->inc("sketched_kmers", sk.size());
+		}
+		return sketches;
+	}
+
+	// Sketches a batch of sequences with the sampling scheme of the run.
+	// FracMinHash sketches LANES sequences of similar lengths at a time on
+	// CPUs with AVX-512.
+	static std::vector<sketch_t> buildSketchBatch(const std::vector<std::string_view> &seqs) {
+		std::vector<sketch_t> sketches(seqs.size());
+		if (cpu_isa() >= Isa::AVX512 && params->sampling == Sampling::FMH) {
+			std::vector<int> order(seqs.size());
+			std::iota(order.begin(), order.end(), 0);
+			std::sort(order.begin(), order.end(), [&](int a, int b) { return seqs[a].size() < seqs[b].size(); });
+
+			std::string_view lane_seqs[LANES];
+			sketch_t lane_sketches[LANES];
+			for (size_t i = 0; i < order.size(); i += LANES) {
+				const int lanes = std::min(LANES, int(order.size() - i));
+				for (int l = 0; l < lanes; l++)
+					lane_seqs[l] = seqs[order[i+l]], lane_sketches[l].clear();
+				buildFMHSketchLanes_avx512(lane_seqs, lanes, params->k, params->hFrac, lane_sketches);
+				for (int l = 0; l < lanes; l++)
+					sketches[order[i+l]] = std::move(lane_sketches[l]);
+			}
+		} else {
+			for (size_t i = 0; i < seqs.size(); i++)
+				sketches[i] = buildSketch(seqs[i], params->k, params->hFrac);
+		}
+
+		for (size_t i = 0; i < seqs.size(); i++) {
+			C->inc("sketched_seqs");
+			C->inc("sketched_len", seqs[i].size());
+			C->inc("original_kmers", sketches[i].size());
+			C->inc("sketched_kmers", sketches[i].size());
+		}
+		return sketches;
+	}
+
+	// Sketches a long sequence in `parts` pieces that run as subtasks of
+	// `pool` (with any sampling scheme, since a kmer is sampled based only on
+	// its own sequence). The pieces overlap by k-1 nucleotides and the sketch
+	// is the same as from a single pass.
+	static sketch_t buildSketchParts(std::string_view s, size_t parts, TaskPool &pool) {
+		const int k = params->k;
+		const size_t kmers_cnt = s.size() >= (size_t)k ? s.size() - k + 1 : 0;  // kmers by left end
+		parts = std::max<size_t>(1, std::min(parts, kmers_cnt));
+		std::vector<sketch_t> sketches(parts);
+		pool.parallel_for(parts, [&](size_t i) {
+			const size_t from = kmers_cnt * i / parts, to = kmers_cnt * (i+1) / parts;
+			sketches[i] = buildSketch(s.substr(from, to - from + k - 1), k, params->hFrac);
+			for (auto &kmer: sketches[i])
+				kmer.r += from;
+		});
+
+		sketch_t kmers;
+		for (const auto &sk: sketches)
+			kmers.insert(kmers.end(), sk.begin(), sk.end());
+		C->inc("sketched_seqs");
+		C->inc("sketched_len", s.size());
+		C->inc("original_kmers", kmers.size());
+		C->inc("sketched_kmers", kmers.size());
+		return kmers;
+	}
+
 	sketch_t kmers;   // (kmer hash, kmer's left 0-based position)
 
 	Sketch(const std::string& s) {
-		kmers = buildFMHSketch(s, params->k, params->hFrac);
+		kmers = buildSketch(s, params->k, params->hFrac);
 		C->inc("sketched_seqs");
 		C->inc("sketched_len", s.size());
 		C->inc("original_kmers", kmers.size());
 		C->inc("sketched_kmers", kmers.size());
 	}
 
+	// A precomputed sketch, e.g. loaded from a sketch file.
+	Sketch(sketch_t &&kmers) : kmers(std::move(kmers)) {}
+
 	static void print_stats() {
 		cerr << std::fixed << std::setprecision(1);
 		cerr << "Sketching:" << endl;
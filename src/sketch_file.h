@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "sketch.h"
+#include "utils.h"
+
+namespace sweepmap {
+
+// Binary file with the sketches of a set of reads, so that repeated mapping
+// runs skip FASTA parsing and sketching altogether.
+//
+// Layout (little-endian, no padding):
+//   header: magic[8] "SWMSKTCH", uint32 version, int32 k, double hFrac, uint8 sampling
+//   record: uint32 name_len, char name[name_len], int32 read_len, uint32 n,
+//           uint32 r_strand[n] (r | strand<<31), uint64 h[n]
+class SketchFile {
+public:
+	static constexpr char MAGIC[8] = {'S','W','M','S','K','T','C','H'};
+	static constexpr uint32_t VERSION = 2;
+
+	static bool is_sketch_file(const std::string &filename) {
+		std::ifstream in(filename, std::ios::binary);
+		char magic[sizeof(MAGIC)];
+		if (!in.read(magic, sizeof(magic))) return false;
+		return std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+	}
+};
+
+class SketchFileWriter {
+	std::ofstream out;
+
+	template<typename V>
+	void put(const V &v) {
+		out.write(reinterpret_cast<const char*>(&v), sizeof(V));
+	}
+
+public:
+	SketchFileWriter(const std::string &filename, int k, double hFrac, Sampling sampling)
+		: out(filename, std::ios::binary) {
+		if (!out) {
+			std::cerr << "ERROR: Cannot open sketch file " << filename << " for writing." << std::endl;
+			exit(1);
+		}
+		out.write(SketchFile::MAGIC, sizeof(SketchFile::MAGIC));
+		put(SketchFile::VERSION);
+		put(int32_t(k));
+		put(hFrac);
+		put(uint8_t(sampling));
+	}
+
+	void write(const std::string &name, pos_t read_len, const Sketch::sketch_t &kmers) {
+		put(uint32_t(name.size()));
+		out.write(name.data(), name.size());
+		put(int32_t(read_len));
+		put(uint32_t(kmers.size()));
+
+		std::vector<uint32_t> r_strand(kmers.size());
+		std::vector<hash_t> h(kmers.size());
+		for (size_t i = 0; i < kmers.size(); i++) {
+			r_strand[i] = uint32_t(kmers[i].r) | (uint32_t(kmers[i].strand) << 31);
+			h[i] = kmers[i].h;
+		}
+		out.write(reinterpret_cast<const char*>(r_strand.data()), r_strand.size() * sizeof(uint32_t));
+		out.write(reinterpret_cast<const char*>(h.data()), h.size() * sizeof(hash_t));
+	}
+};
+
+class SketchFileReader {
+	std::ifstream in;
+	std::string filename;
+
+	template<typename V>
+	bool get(V *v) {
+		return bool(in.read(reinterpret_cast<char*>(v), sizeof(V)));
+	}
+
+	void fail(const std::string &msg) {
+		std::cerr << "ERROR: " << filename << ": " << msg << std::endl;
+		exit(1);
+	}
+
+public:
+	int k;
+	double hFrac;
+	Sampling sampling;
+
+	SketchFileReader(const std::string &filename)
+		: in(filename, std::ios::binary), filename(filename) {
+		char magic[sizeof(SketchFile::MAGIC)];
+		uint32_t version;
+		int32_t k32;
+		if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, SketchFile::MAGIC, sizeof(magic)) != 0)
+			fail("not a sweepmap sketch file.");
+		if (!get(&version) || version != SketchFile::VERSION)
+			fail("unsupported sketch file version.");
+		uint8_t sampling8;
+		if (!get(&k32) || !get(&hFrac) || !get(&sampling8))
+			fail("truncated header.");
+		k = k32;
+		sampling = Sampling(sampling8);
+	}
+
+	// Calls `callback(name, read_len, kmers)` for every record in the file.
+	void read_all(std::function<void(const std::string&, pos_t, Sketch::sketch_t&&)> callback) {
+		uint32_t name_len, n;
+		int32_t read_len;
+		std::string name;
+		std::vector<uint32_t> r_strand;
+		std::vector<hash_t> h;
+
+		while (get(&name_len)) {
+			name.resize(name_len);
+			if (!in.read(name.data(), name_len) || !get(&read_len) || !get(&n))
+				fail("truncated record.");
+			r_strand.resize(n);
+			h.resize(n);
+			if (!in.read(reinterpret_cast<char*>(r_strand.data()), n * sizeof(uint32_t))
+				|| !in.read(reinterpret_cast<char*>(h.data()), n * sizeof(hash_t)))
+				fail("truncated record.");
+
+			Sketch::sketch_t kmers;
+			kmers.reserve(n);
+			for (uint32_t i = 0; i < n; i++)
+				kmers.push_back(Kmer(pos_t(r_strand[i] & 0x7fff'ffff), h[i], r_strand[i] >> 31));
+			callback(name, read_len, std::move(kmers));
+		}
+	}
+};
+
+} // namespace sweepmap
@@ -1,33 +1,144 @@
+#include "cpu.h"
 #include "index.h"
+#include "sketch_file.h"
 #include "sweepmap.h"
 
 using namespace sweepmap;
 
-void print_time_stats(Timers *T, Counters *C) {
+void print_time_stats(const params_t &params, Timers *T, Counters *C) {
 	cerr << std::fixed << std::setprecision(1);
 	cerr << "Time [sec]:           "             << setw(5) << right << T->secs("total")             << endl;
-	cerr << " | Index:                 "         << setw(5) << right << T->secs("indexing")          << " (" << setw(4) << right << T->perc("indexing", "total")              << "\%)" << endl;
-	cerr << " |  | loading:                "     << setw(5) << right << T->secs("index_reading")     << " (" << setw(4) << right << T->perc("index_reading", "indexing")      << "\%)" << endl;
-	cerr << " |  | sketch:                 "     << setw(5) << right << T->secs("index_sketching")   << " (" << setw(4) << right << T->perc("index_sketching", "indexing")    << "\%)" << endl;
-	cerr << " |  | initialize:             "     << setw(5) << right << T->secs("index_initializing")<< " (" << setw(4) << right << T->perc("index_initializing", "indexing") << "\%)" << endl;
+	if (SWEEPMAP_VERBOSITY >= 1) {
+		cerr << " | Index:                 "         << setw(5) << right << T->secs("indexing")          << " (" << setw(4) << right << T->perc("indexing", "total")              << "\%)" << endl;
+		cerr << " |  | loading:                "     << setw(5) << right << T->secs("index_reading")     << " (" << setw(4) << right << T->perc("index_reading", "indexing")      << "\%)" << endl;
+		cerr << " |  | sketch:                 "     << setw(5) << right << T->secs("index_sketching")   << " (" << setw(4) << right << T->perc("index_sketching", "indexing")    << "\%)" << endl;
+		cerr << " |  | initialize:             "     << setw(5) << right << T->secs("index_initializing")<< " (" << setw(4) << right << T->perc("index_initializing", "indexing") << "\%)" << endl;
+	}
 	cerr << " | Map:                   "         << setw(5) << right << T->secs("mapping")           << " (" << setw(4) << right << T->perc("mapping", "total")               << "\%, " << setw(5) << right << T->range_ratio("query_mapping") << "x, " << setw(4) << right << C->count("reads") / T->secs("total") << " reads per sec)" << endl;
-	cerr << " |  | load queries:           "     << setw(5) << right << T->secs("query_reading")     << " (" << setw(4) << right << T->perc("query_reading", "mapping")       << "\%, " << setw(5) << right << T->range_ratio("query_reading") << "x)" << endl;
-	cerr << " |  | sketch reads:           "     << setw(5) << right << T->secs("sketching")         << " (" << setw(4) << right << T->perc("sketching", "mapping")           << "\%, " << setw(5) << right << T->range_ratio("sketching") << "x)" << endl;
-	cerr << " |  | seeding:                "     << setw(5) << right << T->secs("seeding")           << " (" << setw(4) << right << T->perc("seeding", "mapping")             << "\%, " << setw(5) << right << T->range_ratio("seeding") << "x)" << endl;
-	cerr << " |  |  | collect seed info:       " << setw(5) << right << T->secs("collect_seed_info") << " (" << setw(4) << right << T->perc("collect_seed_info", "seeding")   << "\%, " << setw(5) << right << T->range_ratio("collect_seed_info") << "x)" << endl;
-	cerr << " |  |  | thin sketch:             " << setw(5) << right << T->secs("thin_sketch")       << " (" << setw(4) << right << T->perc("thin_sketch", "seeding")         << "\%, " << setw(5) << right << T->range_ratio("thin_sketch") << "x)" << endl;
-	cerr << " |  |  | sort seeds:              " << setw(5) << right << T->secs("sort_seeds")        << " (" << setw(4) << right << T->perc("sort_seeds", "seeding")          << "\%, " << setw(5) << right << T->range_ratio("sort_seeds") << "x)" << endl;
-	cerr << " |  |  | unique seeds:            " << setw(5) << right << T->secs("unique_seeds")      << " (" << setw(4) << right << T->perc("unique_seeds", "seeding")        << "\%, " << setw(5) << right << T->range_ratio("unique_seeds") << "x)" << endl;
-	cerr << " |  | matching seeds:         "     << setw(5) << right << T->secs("matching")          << " (" << setw(4) << right << T->perc("matching", "mapping")            << "\%, " << setw(5) << right << T->range_ratio("matching") << "x)" << endl;
-	cerr << " |  |  | collect matches:         " << setw(5) << right << T->secs("collect_matches")   << " (" << setw(4) << right << T->perc("collect_matches", "matching")    << "\%, " << setw(5) << right << T->range_ratio("collect_matches") << "x)" << endl;
-	cerr << " |  |  | sort matches:            " << setw(5) << right << T->secs("sort_matches")      << " (" << setw(4) << right << T->perc("sort_matches", "matching")       << "\%, " << setw(5) << right << T->range_ratio("sort_matches") << "x)" << endl;
-	cerr << " |  | sweep:                  "     << setw(5) << right << T->secs("sweep")             << " (" << setw(4) << right << T->perc("sweep", "mapping")               << "\%, " << setw(5) << right << T->range_ratio("sweep") << "x)" << endl;
-	cerr << " |  | post proc:              "     << setw(5) << right << T->secs("postproc")          << " (" << setw(4) << right << T->perc("postproc", "mapping")            << "\%, " << setw(5) << right << T->range_ratio("postproc") << "x)" << endl;
+	if (SWEEPMAP_VERBOSITY >= 1) {
+		cerr << " |  | load queries:           "     << setw(5) << right << T->secs("query_reading")     << " (" << setw(4) << right << T->perc("query_reading", "mapping")       << "\%, " << setw(5) << right << T->range_ratio("query_reading") << "x)" << endl;
+		cerr << " |  | sketch reads:           "     << setw(5) << right << T->secs("sketching")         << " (" << setw(4) << right << T->perc("sketching", "mapping")           << "\%, " << setw(5) << right << T->range_ratio("sketching") << "x)" << endl;
+		cerr << " |  | seeding:                "     << setw(5) << right << T->secs("seeding")           << " (" << setw(4) << right << T->perc("seeding", "mapping")             << "\%, " << setw(5) << right << T->range_ratio("seeding") << "x)" << endl;
+		if (SWEEPMAP_VERBOSITY >= 2) {
+			cerr << " |  |  | collect seed info:       " << setw(5) << right << T->secs("collect_seed_info") << " (" << setw(4) << right << T->perc("collect_seed_info", "seeding")   << "\%, " << setw(5) << right << T->range_ratio("collect_seed_info") << "x)" << endl;
+			cerr << " |  |  | thin sketch:             " << setw(5) << right << T->secs("thin_sketch")       << " (" << setw(4) << right << T->perc("thin_sketch", "seeding")         << "\%, " << setw(5) << right << T->range_ratio("thin_sketch") << "x)" << endl;
+			cerr << " |  |  | sort seeds:              " << setw(5) << right << T->secs("sort_seeds")        << " (" << setw(4) << right << T->perc("sort_seeds", "seeding")          << "\%, " << setw(5) << right << T->range_ratio("sort_seeds") << "x)" << endl;
+			cerr << " |  |  | unique seeds:            " << setw(5) << right << T->secs("unique_seeds")      << " (" << setw(4) << right << T->perc("unique_seeds", "seeding")        << "\%, " << setw(5) << right << T->range_ratio("unique_seeds") << "x)" << endl;
+		}
+		if (params.coarse > 0.0)
+			cerr << " |  | coarse level:           "     << setw(5) << right << T->secs("coarse")            << " (" << setw(4) << right << T->perc("coarse", "mapping")              << "\%, " << setw(5) << right << T->range_ratio("coarse") << "x)" << endl;
+		cerr << " |  | matching seeds:         "     << setw(5) << right << T->secs("matching")          << " (" << setw(4) << right << T->perc("matching", "mapping")            << "\%, " << setw(5) << right << T->range_ratio("matching") << "x)" << endl;
+		if (SWEEPMAP_VERBOSITY >= 2) {
+			cerr << " |  |  | collect matches:         " << setw(5) << right << T->secs("collect_matches")   << " (" << setw(4) << right << T->perc("collect_matches", "matching")    << "\%, " << setw(5) << right << T->range_ratio("collect_matches") << "x)" << endl;
+			cerr << " |  |  | sort matches:            " << setw(5) << right << T->secs("sort_matches")      << " (" << setw(4) << right << T->perc("sort_matches", "matching")       << "\%, " << setw(5) << right << T->range_ratio("sort_matches") << "x)" << endl;
+		}
+		cerr << " |  | sweep:                  "     << setw(5) << right << T->secs("sweep")             << " (" << setw(4) << right << T->perc("sweep", "mapping")               << "\%, " << setw(5) << right << T->range_ratio("sweep") << "x)" << endl;
+		cerr << " |  | post proc:              "     << setw(5) << right << T->secs("postproc")          << " (" << setw(4) << right << T->perc("postproc", "mapping")            << "\%, " << setw(5) << right << T->range_ratio("postproc") << "x)" << endl;
+	}
 //		cerr << "Virtual memory [MB]:  "             << setw(5) << right << C->count("total_memory_MB")  << endl;
 //		cerr << " | Index:                 "         << setw(5) << right << C->count("index_memory_MB") << " (" << setw(4) << right << C->perc("index_memory_MB", "total_memory_MB") << "\%)" << endl;
 	printMemoryUsage();
 }
 
+void write_params(params_t &params) {
+	if (!params.paramsFile.empty()) {
+		cerr << "Writing parameters to " << params.paramsFile << "..." << endl;
+		auto fout = std::ofstream(params.paramsFile);
+		params.print(fout, false);
+	} else {
+		params.print(cerr, true);
+	}
+}
+
+// Output file of a multi-k run for the kmer length `k`.
+string kgrid_file(const params_t &params, int k, const string &ext) {
+	return params.outFile + "-K" + std::to_string(k) + ext;
+}
+
+// `sweepmap sketch`: writes the sketches of all queries to a sketch file (one
+// per k for multiple kmer lengths).
+void sketch_queries(const params_t &params, Timers *T, Counters *C) {
+	std::vector<std::unique_ptr<SketchFileWriter>> writers;
+	if (params.ks.size() > 1)
+		for (int k: params.ks)
+			writers.emplace_back(new SketchFileWriter(kgrid_file(params, k, ".sks"), k, params.hFrac, params.sampling));
+	else
+		writers.emplace_back(new SketchFileWriter(params.outFile, params.k, params.hFrac, params.sampling));
+
+	cerr << "Sketching reads " << params.pFile << " to " << params.outFile << "..." << endl;
+	T->start("query_reading");
+	read_fasta_klib(params.pFile, [&](kseq_t *seq) {
+		T->stop("query_reading");
+		T->start("sketching");
+		if (params.ks.size() > 1) {
+			auto sketches = Sketch::buildSketches(seq->seq.s, params.ks, params.hFrac);
+			for (size_t i = 0; i < sketches.size(); i++)
+				writers[i]->write(seq->name.s, (pos_t)seq->seq.l, sketches[i]);
+		} else {
+			Sketch p(seq->seq.s);
+			writers[0]->write(seq->name.s, (pos_t)seq->seq.l, p.kmers);
+		}
+		T->stop("sketching");
+		C->inc("reads");
+		T->start("query_reading");
+	});
+	T->stop("query_reading");
+}
+
+// Multi-k run: builds all per-k indexes from one pass over the reference and
+// maps every read with all of them after sketching it once for all k. The
+// mappings for each k go to a separate output file.
+void map_kgrid(const params_t &params, Timers *T, Counters *C) {
+	if (SketchFile::is_sketch_file(params.pFile)) {
+		cerr << "ERROR: Multiple kmer lengths need FASTA queries; sketch files hold a single k." << endl;
+		exit(1);
+	}
+
+	std::deque<params_t> kparams;
+	std::deque<Counters> kC;
+	std::deque<SketchIndex> tidxs;
+	std::vector<SketchIndex*> tidx_ptrs;
+	for (int k: params.ks) {
+		kparams.push_back(params);
+		kparams.back().k = k;
+		kparams.back().ks = {k};
+		kC.emplace_back();
+		tidxs.emplace_back(kparams.back(), T, &kC.back());
+		tidx_ptrs.push_back(&tidxs.back());
+	}
+	SketchIndex::build_indexes(params.tFile, tidx_ptrs, T);
+
+	std::deque<std::ofstream> outs;
+	std::deque<SweepMap> sweepmaps;
+	for (size_t i = 0; i < params.ks.size(); i++) {
+		outs.emplace_back(kgrid_file(params, params.ks[i], params.sam ? ".sam" : ".paf"));
+		sweepmaps.emplace_back(tidxs[i], kparams[i], T, &kC[i], outs.back());
+	}
+
+	cerr << "Mapping reads " << params.pFile << " to " << params.outFile << "-K*..." << endl;
+	T->start("mapping");
+	T->start("query_reading");
+	read_fasta_klib(params.pFile, [&](kseq_t *seq) {
+		T->stop("query_reading");
+		T->start("query_mapping");
+		T->start("sketching");
+		auto sketches = Sketch::buildSketches(seq->seq.s, params.ks, params.hFrac);
+		T->stop("sketching");
+		for (size_t i = 0; i < sketches.size(); i++)
+			sweepmaps[i].map_read(seq->name.s, (pos_t)seq->seq.l, Sketch(std::move(sketches[i])), seq->seq.s);
+		C->inc("reads");
+		T->stop("query_mapping");
+		T->start("query_reading");
+	});
+	T->stop("query_reading");
+	T->stop("mapping");
+
+	for (size_t i = 0; i < params.ks.size(); i++) {
+		cerr << "k=" << params.ks[i] << ":" << endl;
+		sweepmaps[i].print_stats();
+	}
+}
+
 int main(int argc, char **argv) {
 
 	Counters C;
@@ -41,30 +152,46 @@ int main(int argc, char **argv) {
 
 	T.start("total");
 
+	if (argc > 1 && string(argv[1]) == "sketch") {
+		params.sketch_only = true;
+		--argc, ++argv;
+	}
+
 	if(!prsArgs(argc, argv, &params)) {
 		dsHlp();
 		return 1;
 	}
+	if (params.cpu_report) {
+		print_cpu_report(std::cerr);
+		if (params.pFile.empty())
+			return 0;
+	}
 	params.print_display(std::cerr);
 
-	SketchIndex tidx(params, &T, &C);
-	tidx.build_index(params.tFile);
+	if (params.sketch_only) {
+		sketch_queries(params, &T, &C);
+		T.stop("total");
+		Sketch::print_stats();
+		cerr << "Time [sec]:           " << setw(5) << right << T.secs("total") << " (" << C.count("reads") << " reads)" << endl;
+		return 0;
+	}
 
-	if (!params.paramsFile.empty()) {
-		cerr << "Writing parameters to " << params.paramsFile << "..." << endl;
-		auto fout = std::ofstream(params.paramsFile);
-		params.print(fout, false);
+	if (params.ks.size() > 1) {
+		write_params(params);
+		map_kgrid(params, &T, &C);
 	} else {
-		params.print(cerr, true);
-	}
+		SketchIndex tidx(params, &T, &C);
+		tidx.build_index(params.tFile);
+		write_params(params);
 
-	cerr << "Mapping reads " << params.pFile << "..." << endl;
-	SweepMap sweepmap(tidx, params, &T, &C);
-	sweepmap.map(params.pFile);
+		cerr << "Mapping reads " << params.pFile << "..." << endl;
+		SweepMap sweepmap(tidx, params, &T, &C);
+		sweepmap.map(params.pFile);
+	}
 
 	T.stop("total");
 	Sketch::print_stats();
-	print_time_stats(&T, &C);
+	print_time_stats(params, &T, &C);
 
 	return 0;
 }
@@ -1,17 +1,30 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <deque>
+#include <functional>
 #include <iomanip>
+#include <map>
+#include <memory>
+#include <numeric>
 #include <set>
+#include <sstream>
+#include <thread>
 
 #include "../ext/edlib.h"
 #include "../ext/pdqsort.h"
 
+#include "arena.h"
+#include "diff_hist.h"
 #include "index.h"
 #include "io.h"
+#include "pipeline.h"
+#include "radix_sort.h"
+#include "scheduler.h"
 #include "sketch.h"
+#include "sketch_file.h"
 
 namespace sweepmap {
 
@@ -33,19 +46,29 @@ struct Mapping {
 	int mapq;
 	char strand;    // '+' or '-'
 	bool unreasonable;  // reserved for filtering matches
-	vector<Match>::const_iterator l, r;
+	matches_t::const_iterator l, r;
 
     Mapping() {}
-	Mapping(int k, pos_t P_sz, int seeds, pos_t T_l, pos_t T_r, segm_t segm_id, pos_t s_sz, int xmin, int same_strand_seeds, vector<Match>::const_iterator l, vector<Match>::const_iterator r)
+	Mapping(int k, pos_t P_sz, int seeds, pos_t T_l, pos_t T_r, segm_t segm_id, pos_t s_sz, int xmin, int same_strand_seeds, matches_t::const_iterator l, matches_t::const_iterator r)
 		: k(k), P_sz(P_sz), seeds(seeds), T_l(T_l), T_r(T_r), segm_id(segm_id), s_sz(s_sz), xmin(xmin), J(double(xmin) / std::max(seeds, s_sz)), mapq(255), strand(same_strand_seeds > 0 ? '+' : '-'), unreasonable(false), l(l), r(r) {}
 
 	// --- https://github.com/lh3/miniasm/blob/master/PAF.md ---
-    void print_paf(const string &query_id, const RefSegment &segm, vector<Match> matches) const {
-		int P_start = P_sz, P_end = -1;
+    void print_paf(std::ostream &out, const string &query_id, const RefSegment &segm, const seeds_t &thin_seeds, const matches_t &matches) const {
+		int P_start, P_end;
+		query_range(thin_seeds, &P_start, &P_end);
+		print_paf(out, query_id, segm, P_start, P_end, matches.size());
+	}
+
+	// The positions of the seeds of the matches in the pattern.
+	void query_range(const seeds_t &thin_seeds, int *P_start, int *P_end) const {
+		*P_start = P_sz, *P_end = -1;
 		for (auto m = l; m != r; ++m) {
-			P_start = std::min(P_start, m->seed.r_first);
-			P_end = std::max(P_end, m->seed.r_last);
+			*P_start = std::min(*P_start, thin_seeds[m->seed_num()].r_first);
+			*P_end = std::max(*P_end, thin_seeds[m->seed_num()].r_last);
 		}
+	}
+
+    void print_paf(std::ostream &out, const string &query_id, const RefSegment &segm, int P_start, int P_end, size_t matches) const {
 		if (!(0 <= P_start && P_start <= P_end && P_end <= P_sz))
 			std::cerr << "P_start=" << P_start << " P_end=" << P_end << " P_sz=" << P_sz << std::endl;
 		assert(0 <= P_start && P_start <= P_end && P_end <= P_sz);
@@ -53,7 +76,7 @@ struct Mapping {
 		auto T_l_predicted = std::max(T_l-P_start, 0);  // -P_start -- P_start too big
 		auto T_r_predicted = std::min(T_r+(P_sz-P_end), segm.sz);  // +(P_sz-P_end) too big
 
-		std::cout << query_id  			// Query sequence name
+		out << query_id  			// Query sequence name
 			<< "\t" << P_sz     // query sequence length
 			<< "\t" << P_start   // query start (0-based; closed)
 			<< "\t" << P_end  // query end (0-based; open)
@@ -68,7 +91,7 @@ struct Mapping {
 // ----- end of required PAF fields -----
 			<< "\t" << "k:i:" << k
 			<< "\t" << "p:i:" << seeds  // sketches
-			<< "\t" << "M:i:" << matches.size() // kmer matches in T
+			<< "\t" << "M:i:" << matches // kmer matches in T
 			<< "\t" << "s:i:" << s_sz
 			<< "\t" << "I:i:" << xmin  // intersection of `p` and `s` [kmers]
 			<< "\t" << "J:f:" << J   // Jaccard similarity [0; 1]
@@ -77,7 +100,7 @@ struct Mapping {
 			<< endl;
 	}
 
-    int print_sam(const string &query_id, const RefSegment &segm, const int matches, const char *query, const size_t query_size) const {
+    int print_sam(std::ostream &out, const string &query_id, const RefSegment &segm, const int matches, const char *query, const size_t query_size) const {
 		int T_start = std::max(T_l-k, 0);
 		int T_end = std::max(T_r, T_l-k+P_sz);
 		int T_d = T_end - T_start;
@@ -96,7 +119,7 @@ struct Mapping {
 		int ed = result.editDistance;
 		int flag = 0;
 		if (strand == '-') flag |= 0x10;
-		std::cout << query_id 				// 1 QNAME String [!-?A-~]{1,254} Query template NAME
+		out << query_id 				// 1 QNAME String [!-?A-~]{1,254} Query template NAME
 			<< "\t" << flag 				// 2 FLAG Int [0, 216 − 1] bitwise FLAG
 			<< "\t" << segm.name  			// 3 RNAME String \*|[:rname:∧*=][:rname:]* Reference sequence NAME11
 			<< "\t" << T_start+1  			// 4 POS Int [0, 231 − 1] 1-based leftmost mapping POSition
@@ -118,25 +141,228 @@ struct Mapping {
 	}
 };
 
+// ReasonableFilter -- keeps only the reasonable mappings (those that are
+// not J-dominated by another overlapping mapping) of a stream of mappings
+// ordered by T_l. The recent mappings wait in a ring buffer until they are
+// too far behind to be dominated, so only the reasonable ones are stored.
+// The buffer has a fixed capacity that doubles only when the mappings
+// within the separation distance do not fit. O(1) amortized per mapping.
+// With `top` > 0, only the `top` reasonable mappings with the largest xmin
+// are kept, in a min-heap by xmin, and mappings on different segments are
+// always separated. (Without it, T_l is compared across segments as before,
+// so which mappings are kept depends on all windows, including the ones
+// that the sweep skips in the top mode.)
+class ReasonableFilter {
+	std::pmr::vector<Mapping> *reasonable;
+	const pos_t sep;  // minimal separation between mappings to be considered reasonable
+	const size_t top;
+
+	static bool larger_xmin(const Mapping &a, const Mapping &b) {
+		return a.xmin > b.xmin;
+	}
+
+	void emit(const Mapping &m) {
+		if (top == 0) {
+			reasonable->push_back(m);
+		} else if (reasonable->size() < top) {
+			reasonable->push_back(m);
+			std::push_heap(reasonable->begin(), reasonable->end(), larger_xmin);
+		} else if (m.xmin > reasonable->front().xmin) {
+			std::pop_heap(reasonable->begin(), reasonable->end(), larger_xmin);
+			reasonable->back() = m;
+			std::push_heap(reasonable->begin(), reasonable->end(), larger_xmin);
+		}
+	}
+
+	// The ring `recent' is sorted decreasingly by J
+	//					  _________`recent'_________
+	//                   /                          \
+	// ---------------- | High J ... Mid J ... Low J | current J
+	// already removed    ring.back ... ring.front      to add next
+	std::pmr::vector<Mapping> ring;
+	size_t front_idx = 0, n = 0;
+
+	std::pmr::vector<Mapping> *held = nullptr;  // see hold()
+	pos_t held_max_T_l = 0;
+
+	Mapping &at(size_t i) { return ring[(front_idx + i) & (ring.size() - 1)]; }  // 0 is the front
+	Mapping &front() { return at(0); }
+	Mapping &back() { return at(n - 1); }
+
+	void push_front(const Mapping &m) {
+		if (n == ring.size()) {
+			std::pmr::vector<Mapping> larger(2 * ring.size(), ring.get_allocator());
+			for (size_t i = 0; i < n; i++)
+				larger[i] = at(i);
+			ring.swap(larger);
+			front_idx = 0;
+		}
+		front_idx = (front_idx - 1) & (ring.size() - 1);
+		++n;
+		front() = m;
+	}
+
+public:
+	static constexpr size_t INIT_CAPACITY = 64;  // a power of two
+
+	ReasonableFilter(std::pmr::vector<Mapping> *reasonable, pos_t P_len, double tThres, std::pmr::memory_resource *mr, size_t top = 0)
+		: reasonable(reasonable), sep(pos_t((1.0 - tThres) * double(P_len))), top(top), ring(INIT_CAPACITY, mr) {}
+
+	// The xmin that a mapping has to exceed to be kept: -1 until there are
+	// `top` mappings. A mapping with at most this xmin cannot affect whether
+	// the mappings with larger xmin are reasonable, so it need not be pushed.
+	int floor() const {
+		return top > 0 && reasonable->size() == top ? reasonable->front().xmin : -1;
+	}
+
+	// For a part of a sweep that follows mappings with T_l up to `max_T_l`:
+	// the mappings are appended to `held` unfiltered until one of them is
+	// farther than the separation from all mappings before it. Whatever the
+	// earlier mappings are, the ring of the sequential filter is empty after
+	// that mapping gets in, so the rest of the part is filtered here and the
+	// parts are joined by join().
+	void hold(std::pmr::vector<Mapping> *held, pos_t max_T_l) {
+		this->held = held;
+		held_max_T_l = max_T_l;
+	}
+
+	// Emits the mappings in the ring, as step 1 does for a far mapping.
+	void flush() {
+		while (n > 0) {
+			if (!back().unreasonable) {
+				emit(back());
+				for (size_t i = n; i-- > 0 && at(i).T_l - back().T_l < sep; )
+					at(i).unreasonable = true;
+			}
+			--n;
+		}
+	}
+
+	// Continues with the next part of the sweep, whose mappings went to
+	// `part` after hold(&part_held, ...) and its emitted ones to `part_reasonable`.
+	void join(const ReasonableFilter &part, const std::pmr::vector<Mapping> &part_held, const std::pmr::vector<Mapping> &part_reasonable) {
+		for (const auto &m: part_held)
+			push(m);
+		if (part.held)
+			return;  // the whole part was held
+		flush();
+		for (const auto &m: part_reasonable)
+			emit(m);
+		for (size_t i = part.n; i-- > 0; )
+			push_front(part.ring[(part.front_idx + i) & (part.ring.size() - 1)]);
+	}
+
+	void push(const Mapping &next) {
+		if (held) {
+			if (next.T_l - held_max_T_l <= sep) {
+				held->push_back(next);
+				held_max_T_l = std::max(held_max_T_l, next.T_l);
+				return;
+			}
+			held = nullptr;
+		}
+
+		// 1. Prepare for adding `curr' by removing from the ring back all
+		//    mappings that are too far to the left. This keeps the ring
+		//    within |P| from back to front. A mapping can become reasonable
+		//    only after getting removed.
+		while(n > 0 && ((top > 0 && next.segm_id != back().segm_id) || next.T_l - back().T_l > sep)) {
+			// If the mapping is not marked as unreasonable (coverted by a preivous better mapping)
+			if (!back().unreasonable) {
+				// Take the leftmost mapping.
+				emit(back());
+				// Mark the next closeby mappings as not reasonable
+				for (size_t i = n; i-- > 0 && at(i).T_l - back().T_l < sep; )
+					at(i).unreasonable = true;
+			}
+			// Remove the mapping that is already too much behind.
+			--n;
+		}
+		assert(n == 0 || (back().T_r <= front().T_r && front().T_r <= next.T_r));
+
+		// Now all the mappings in `recent' are close to `curr' 
+		// 2. Remove from the ring front all mappings that are strictly
+		//    less similar than the current J. This keeps the ring sorted
+		//    descending in J from left to right
+		while(n > 0 && front().xmin < next.xmin) {
+			front_idx = (front_idx + 1) & (ring.size() - 1);
+			--n;
+		}
+		assert(n == 0 || (back().xmin >= front().xmin && front().xmin >= next.xmin));
+
+		// 3. Add the next mapping to the front
+		push_front(next);
+
+		// 4. If there is another mapping in the ring, it is near and better.
+		if (n > 1)
+			front().unreasonable = true;
+	}
+
+	// 5. Add the last mapping if it is reasonable
+	void finish() {
+		if (n > 0 && !back().unreasonable)
+			emit(back());
+		n = 0;
+		if (top > 0)
+			std::sort(reasonable->begin(), reasonable->end(), [](const Mapping &a, const Mapping &b) {
+				if (a.xmin != b.xmin)
+					return a.xmin > b.xmin;
+				return a.segm_id != b.segm_id ? a.segm_id < b.segm_id : a.T_l < b.T_l;
+			});
+	}
+};
+
+// The kinds of sweeps, each with its own instance of the sweep kernel:
+//  BEST: --onlybest, the best and the second best mapping,
+//  TOP:  --top, the best reasonable mappings,
+//  ALL:  all mappings above the threshold, reasonable or overlapping (-o).
+enum class SweepMode { BEST, TOP, ALL };
+
 class SweepMap {
 	const SketchIndex &tidx;
 	const params_t &params;
 	Timers *T;
 	Counters *C;
+	std::ostream &out;
+
+	using hist_t = std::pmr::vector<int>;
+	using mappings_t = std::pmr::vector<Mapping>;
+	using sweep_kernel_t = void (SweepMap::*)(DiffHist &, const matches_t &, matches_t::const_iterator, matches_t::const_iterator,
+			const pos_t, const int, const double, ReasonableFilter *, mappings_t *);
 
-	using hist_t = vector<int>;
+	const SweepMode sweep_mode;  // of the mapping; the coarse level always uses ALL
 
-	vector<Seed> select_seeds(const Sketch& p, hist_t *hist) {
+	Arena arena;  // for the containers of the current read
+
+	MULTIVERSION
+	seeds_t select_seeds(const Sketch& p, int max_seeds, int match_budget, hist_t *hist) {
 		T->start("collect_seed_info");
-		vector<Seed> seeds;
+		seeds_t seeds(&arena);
 		seeds.reserve(p.kmers.size());
 
 		// TODO: limit The number of kmers in the pattern p
-		for (int ppos = 0; ppos < (int)p.kmers.size(); ++ppos) {
-			const auto &kmer = p.kmers[ppos];
-			const auto count = tidx.count(kmer.h);
-			if (count > 0)
-				seeds.push_back(Seed(kmer, p.kmers[ppos].r, p.kmers[ppos].r, count));
+		auto collect = [&](int from, int to, auto *seeds) {
+			for (int ppos = from; ppos < to; ++ppos) {
+				if (ppos + PREFETCH_DIST < to)
+					__builtin_prefetch(tidx.lookup_addr(p.kmers[ppos + PREFETCH_DIST].h));
+				const auto &kmer = p.kmers[ppos];
+				const auto count = tidx.count(kmer.h);
+				if (count > 0)
+					seeds->push_back(Seed(kmer, p.kmers[ppos].r, p.kmers[ppos].r, count));
+			}
+		};
+		const size_t parts = p.kmers.size() / SPLIT_KMERS;
+		if (pool && pool->size() > 1 && parts > 1) {
+			// The index lookups of a long read run as subtasks in the order of
+			// the kmers; their parts are not in the arena of this thread.
+			vector<vector<Seed>> part_seeds(parts);
+			pool->parallel_for(parts, [&](size_t i) {
+				collect(p.kmers.size() * i / parts, p.kmers.size() * (i+1) / parts, &part_seeds[i]);
+			});
+			for (const auto &part: part_seeds)
+				seeds.insert(seeds.end(), part.begin(), part.end());
+		} else {
+			collect(0, p.kmers.size(), &seeds);
 		}
 		T->stop("collect_seed_info");
         C->inc("collected_seeds", seeds.size());
@@ -144,13 +370,19 @@ class SweepMap {
 		T->start("thin_sketch");
 		// TODO: add all seeds to hist
 		int total_seeds = (int)seeds.size();
-		if ((int)params.max_seeds < total_seeds) {
-			total_seeds = (int)params.max_seeds;
+		if (max_seeds < total_seeds) {
+			total_seeds = max_seeds;
 			C->inc("seeds_limit_reached");
 		}
-        std::nth_element(seeds.begin(), seeds.begin() + total_seeds, seeds.end(), [](const Seed &a, const Seed &b) {
-            return a.hits_in_T < b.hits_in_T;
-        });
+		if (params.seed_bins > 0 && total_seeds < (int)seeds.size()) {
+			thin_by_bins(&seeds, total_seeds, p.kmers.back().r + 1);
+		} else {
+	        std::nth_element(seeds.begin(), seeds.begin() + total_seeds, seeds.end(), [](const Seed &a, const Seed &b) {
+	            return a.hits_in_T < b.hits_in_T;
+	        });
+		}
+		if (match_budget > 0)
+			total_seeds = budget_seeds(&seeds, total_seeds, match_budget);
 		T->stop("thin_sketch");
 
 		T->start("sort_seeds");
@@ -160,11 +392,12 @@ class SweepMap {
 		T->stop("sort_seeds");
 
 		T->start("unique_seeds");
-		vector<Seed> thin_seeds;
+		seeds_t thin_seeds(&arena);
 		thin_seeds.reserve(total_seeds);
 		hist->reserve(total_seeds+1);
 		hist->push_back(0);
-		int min_r = p.kmers.size(), max_r = -1;
+		// positions, not kmer indices
+		int min_r = std::numeric_limits<int>::max(), max_r = -1;
 		for (int i=0; i<total_seeds-1; i++) {
 			min_r = std::min(min_r, seeds[i].r_first);
 			max_r = std::max(max_r, seeds[i].r_last);
@@ -173,7 +406,7 @@ class SweepMap {
 				assert(min_r <= max_r);
 				seeds[i].r_first = min_r;
 				seeds[i].r_last = max_r;
-				min_r = p.kmers.size(), max_r = -1;
+				min_r = std::numeric_limits<int>::max(), max_r = -1;
 				hist->push_back(0);
 				thin_seeds.push_back(seeds[i]);
 			}
@@ -184,62 +417,438 @@ class SweepMap {
 		return thin_seeds;
 	}
 
-	// Initializes the histogram of the pattern and the list of matches
-	vector<Match> match_seeds(pos_t p_sz, const vector<Seed> &seeds) {
+	// Stratified thinning: moves to the front the `total_seeds` seeds that
+	// are the rarest within each of `seed_bins` bins of equal length of the
+	// read, so that no part of the read is left without seeds because other
+	// parts are more unique. The limit is split evenly between the bins and
+	// the unused part of a bin with fewer seeds goes to the larger bins.
+	// The seeds are in the order of their positions.
+	void thin_by_bins(seeds_t *seeds, int total_seeds, pos_t len) {
+		const int bins = params.seed_bins;
+		vector<pair<int, int>> ranges;  // [from, to) of the seeds of a bin
+		int from = 0;
+		for (int b = 0; b < bins; b++) {
+			const pos_t bin_end = pos_t(int64_t(len) * (b+1) / bins);
+			const int to = std::partition_point(seeds->begin() + from, seeds->end(), [bin_end](const Seed &s) {
+				return s.r_first < bin_end;
+			}) - seeds->begin();
+			ranges.push_back({from, to});
+			from = to;
+		}
+		std::sort(ranges.begin(), ranges.end(), [](const pair<int, int> &a, const pair<int, int> &b) {
+			return a.second - a.first < b.second - b.first;
+		});
+
+		seeds_t thin(&arena);
+		thin.reserve(seeds->size());
+		vector<int> takes(ranges.size());
+		int left = total_seeds;
+		for (size_t i = 0; i < ranges.size(); i++) {
+			const auto [from, to] = ranges[i];
+			takes[i] = std::min(to - from, left / int(ranges.size() - i));
+			std::nth_element(seeds->begin() + from, seeds->begin() + from + takes[i], seeds->begin() + to, [](const Seed &a, const Seed &b) {
+				return a.hits_in_T < b.hits_in_T;
+			});
+			thin.insert(thin.end(), seeds->begin() + from, seeds->begin() + from + takes[i]);
+			left -= takes[i];
+		}
+		assert(left == 0);
+		// the other seeds after the chosen ones
+		for (size_t i = 0; i < ranges.size(); i++)
+			thin.insert(thin.end(), seeds->begin() + ranges[i].first + takes[i], seeds->begin() + ranges[i].second);
+		*seeds = std::move(thin);
+	}
+
+	// The seed limit of a read of length P_sz: -S, or with --seeds_per_kb
+	// proportional to the length, so that the mapping cost per kb is about
+	// the same for short and long reads.
+	int seed_limit(pos_t P_sz) const {
+		if (params.seeds_per_kb <= 0.0)
+			return params.max_seeds;
+		const double limit = params.seeds_per_kb * double(P_sz) / 1000.0;
+		return int(std::clamp(limit, double(params.min_seeds), double(params.max_seeds)));
+	}
+
+	// Keeps the least frequent of the first `total_seeds` seeds whose
+	// matches fit in `match_budget`, and returns their number.
+	// The occurrences of a kmer are counted once, as they are matched once.
+	int budget_seeds(seeds_t *seeds, int total_seeds, int match_budget) {
+		int64_t matches = 0;
+		for (int i = 0; i < total_seeds; i++)
+			matches += (*seeds)[i].hits_in_T;
+		if (matches <= match_budget)
+			return total_seeds;
+
+		pdqsort_branchless(seeds->begin(), seeds->begin() + total_seeds, [](const Seed &a, const Seed &b) {
+			return a.hits_in_T != b.hits_in_T ? a.hits_in_T < b.hits_in_T : a.kmer.h < b.kmer.h;
+		});
+		matches = 0;
+		for (int i = 0; i < total_seeds; i++) {
+			if (i > 0 && (*seeds)[i].kmer.h == (*seeds)[i-1].kmer.h)
+				continue;
+			if (matches + (*seeds)[i].hits_in_T > match_budget) {
+				C->inc("matches_limit_reached");
+				return i;
+			}
+			matches += (*seeds)[i].hits_in_T;
+		}
+		return total_seeds;
+	}
+
+	// A region of a reference segment that may contain a mapping.
+	struct Region {
+		segm_t segm_id;
+		pos_t from, to;
+	};
+	using regions_t = std::pmr::vector<Region>;
+
+	// Initializes the histogram of the pattern and the list of matches,
+	// only inside `regions` if given.
+	MULTIVERSION
+	matches_t match_seeds(pos_t p_sz, const seeds_t &seeds, const regions_t *regions = nullptr) {
 		T->start("collect_matches");
-		vector<Match> matches;
+		matches_t matches(&arena);
 		matches.reserve(2*(int)seeds.size());
-		for (int seed_num=0; seed_num<(int)seeds.size(); seed_num++)
-			tidx.add_matches(&matches, seeds[seed_num], seed_num);
+		// Two-stage prefetching: the slot of a seed 2*PREFETCH_DIST ahead and
+		// the hits of a seed PREFETCH_DIST ahead, whose slot is cached by now.
+		const int n = seeds.size();
+		for (int seed_num=0; seed_num<n; seed_num++) {
+			if (seed_num + 2*PREFETCH_DIST < n)
+				__builtin_prefetch(tidx.lookup_addr(seeds[seed_num + 2*PREFETCH_DIST].kmer.h));
+			if (seed_num + PREFETCH_DIST < n)
+				__builtin_prefetch(tidx.hits(seeds[seed_num + PREFETCH_DIST].kmer.h).first);
+			if (regions) {
+				tidx.add_matches_in(&matches, seeds[seed_num], seed_num, regions->begin(), regions->end());
+			} else {
+				tidx.add_matches(&matches, seeds[seed_num], seed_num);
+			}
+		}
 		T->stop("collect_matches");
 
 		T->start("sort_matches");
-		//sort
-		pdqsort_branchless(matches.begin(), matches.end(), [](const Match &a, const Match &b) {
-			// Preparation for sweeping: sort M by ascending positions within one reference segment.
-			// NO SPEEDUP: return (int64_t(a.hit.segm_id) << 32 | a.hit.r) < (int64_t(b.hit.segm_id) << 32 | b.hit.r);
-			if (a.hit.segm_id != b.hit.segm_id)
-				return a.hit.segm_id < b.hit.segm_id;
-			return a.hit.r < b.hit.r;
-		});
+		// Preparation for sweeping: sort M by ascending positions within one reference segment.
+		// The keys of the matches of a read are unique, so both sorts give the same order.
+		if (matches.size() >= RADIX_SORT_MIN) {
+			auto *buf = static_cast<Match*>(arena.allocate(matches.size() * sizeof(Match), alignof(Match)));
+			radix_sort(matches.data(), buf, matches.size(), [](const Match &m) { return m.key; });
+		} else {
+			pdqsort_branchless(matches.begin(), matches.end(), [](const Match &a, const Match &b) {
+				return a.key < b.key;
+			});
+		}
 		T->stop("sort_matches");
 
 		return matches;
 	}
 
+	// Renumbers the seeds in the order of their first match along the
+	// reference, so that the window of the sweep updates nearby entries of
+	// the histogram instead of entries in hash order. The seeds without
+	// matches keep their order after the others.
+	void renumber_seeds(seeds_t *seeds, hist_t *hist, matches_t *matches) {
+		const int n = hist->size();
+		std::pmr::vector<int> num(n, -1, &arena);
+		int next = 0;
+		for (auto &m: *matches) {
+			int &s = num[m.seed_num()];
+			if (s < 0)
+				s = next++;
+			m.set_seed_num(s);
+		}
+		for (int i = 0; i < n; i++)
+			if (num[i] < 0)
+				num[i] = next++;
+
+		const seeds_t old_seeds(*seeds, &arena);
+		const hist_t old_hist(*hist, &arena);
+		for (int i = 0; i < (int)old_seeds.size(); i++)
+			(*seeds)[num[i]] = old_seeds[i];
+		for (int i = 0; i < n; i++)
+			(*hist)[num[i]] = old_hist[i];
+	}
+
+	// The coarse level of the two-level mapping. The seeds with hashes below
+	// coarse*hFrac are a FracMinHash sketch of a lower density (FracMinHash
+	// sketches are nested) and a prefix of the seeds, which are sorted by
+	// hash. Sweeps them and returns the regions of the resulting mappings,
+	// extended by |P| on both sides and merged, in the order of the matches.
+	regions_t coarse_regions(const Sketch &p, const seeds_t &thin_seeds, const hist_t &p_hist, const pos_t P_sz) {
+		const hash_t hThres = hash_t(params.coarse * params.hFrac * double(std::numeric_limits<hash_t>::max()));
+		const auto coarse_end = std::partition_point(thin_seeds.begin(), thin_seeds.end(), [hThres](const Seed &s) {
+			return s.kmer.h < hThres;
+		});
+		const seeds_t seeds(thin_seeds.begin(), coarse_end, &arena);
+		hist_t hist(p_hist.begin(), p_hist.begin() + seeds.size() + 1, &arena);
+		hist.back() = 0;
+
+		const matches_t matches = match_seeds(p.kmers.size(), seeds);
+		C->inc("coarse_matches", matches.size());
+		// The reasonable mappings of the coarse seeds, also with --onlybest and
+		// --top: the second best mapping and the MAPQ need the competing loci.
+		// With --onlybest, there is no threshold, but only the mappings within
+		// COARSE_RIVAL of the best one are kept.
+		const mappings_t mappings = sweep(hist, p, matches, P_sz, seeds.size(), SweepMode::ALL, params.onlybest ? 0.0 : params.tThres);
+		double best_J = 0.0;
+		for (const auto &m: mappings)
+			best_J = std::max(best_J, m.J);
+
+		regions_t regions(&arena);
+		for (const auto &m: mappings)
+			if (!params.onlybest || m.J * COARSE_RIVAL >= best_J)
+				regions.push_back(Region{m.segm_id, std::max(m.T_l - P_sz, 0), m.T_r + P_sz});
+		std::sort(regions.begin(), regions.end(), [](const Region &a, const Region &b) {
+			return a.segm_id != b.segm_id ? a.segm_id < b.segm_id : a.from < b.from;
+		});
+		regions_t merged(&arena);
+		for (const auto &region: regions) {
+			if (!merged.empty() && merged.back().segm_id == region.segm_id && region.from <= merged.back().to)
+				merged.back().to = std::max(merged.back().to, region.to);
+			else
+				merged.push_back(region);
+		}
+		return merged;
+	}
+
+	// Upper bounds on the intersection `xmin` of the windows that start in a
+	// bucket of matches. A window spans less than P_len positions, so the
+	// window of a match in bucket [b*P_len, (b+1)*P_len) of a segment ends in
+	// the same or the next bucket, and it has at most as many matches as the
+	// two buckets together.
+	struct Bucket {
+		uint32_t from, to;    // the matches of the bucket
+		uint32_t segm_to;     // the end of the matches of the segment
+		int bound;            // the matches in this and the next bucket
+		int segm_bound;       // the matches in the segment
+		int rest_bound;       // the largest bound of this and all later buckets
+		pos_t max_T_l;        // the last match position in the bucket
+	};
+	using buckets_t = std::pmr::vector<Bucket>;
+
+	buckets_t bound_buckets(const matches_t &M, const pos_t P_len) {
+		buckets_t buckets(&arena);
+		const pos_t width = std::max(P_len, pos_t(1));
+		for (uint32_t i = 0; i < M.size(); ) {
+			uint32_t j = i;
+			const auto segm = M[i].segm_id();
+			const auto id = M[i].hit_r() / width;
+			while (j < M.size() && M[j].segm_id() == segm && M[j].hit_r() / width == id)
+				++j;
+			buckets.push_back(Bucket{i, j, 0, 0, 0, 0, M[j-1].hit_r()});
+			i = j;
+		}
+		for (size_t b = buckets.size(); b-- > 0; ) {
+			auto &bucket = buckets[b];
+			const int size = bucket.to - bucket.from;
+			bucket.bound = size;
+			bucket.segm_to = bucket.to;
+			bucket.segm_bound = size;
+			if (b+1 < buckets.size() && M[bucket.from].segm_id() == M[buckets[b+1].from].segm_id()) {
+				const auto &next = buckets[b+1];
+				if (M[next.from].hit_r() / width == M[bucket.from].hit_r() / width + 1)
+					bucket.bound += next.to - next.from;
+				bucket.segm_to = next.segm_to;
+				bucket.segm_bound += next.segm_bound;
+			}
+			bucket.rest_bound = std::max(bucket.bound, b+1 < buckets.size() ? buckets[b+1].rest_bound : 0);
+		}
+		return buckets;
+	}
+
+	// The windows never cross a segment or a gap of |P| between consecutive
+	// matches, so the sweep over the matches of a long or repetitive read
+	// runs in parts split at such boundaries, as subtasks of the pool. The
+	// parts start with an empty window, each with its own copy of the
+	// histogram and its own filter, which holds back the first mappings of
+	// the part until they cannot depend on the earlier parts (see
+	// ReasonableFilter::hold). The parts are joined in the order of the
+	// matches, which gives the mappings of the sequential sweep, and only
+	// the held and the reasonable mappings of a part are stored until then.
+	// The best and the second best mapping of --onlybest depend on all
+	// previous windows, so --onlybest always sweeps sequentially.
+	// Unless overlaps are requested for the mapping, only the reasonable
+	// mappings with J above `tThres` are kept.
+	mappings_t sweep(const hist_t &p_hist, const Sketch &p, const matches_t &M, const pos_t P_len, const int thin_seeds_cnt,
+			const SweepMode mode, const double tThres) {
+		const sweep_kernel_t kernel = sweep_kernel(mode);
+		mappings_t mappings(&arena);
+		DiffHist diff_hist(p_hist, &arena);
+		ReasonableFilter filter(&mappings, P_len, params.tThres, &arena, mode == SweepMode::TOP ? params.top : 0);
+		ReasonableFilter *reasonable = mode == SweepMode::BEST || (mode == sweep_mode && params.overlaps) ? nullptr : &filter;
+
+		const size_t parts = M.size() / SPLIT_MATCHES;
+		if (!pool || pool->size() <= 1 || parts <= 1 || mode != SweepMode::ALL) {
+			(this->*kernel)(diff_hist, M, M.begin(), M.end(), P_len, thin_seeds_cnt, tThres, reasonable, &mappings);
+		} else {
+			vector<size_t> bounds = {0};
+			for (size_t i = 1; i < parts; i++) {
+				size_t b = std::max(M.size() * i / parts, bounds.back() + 1);
+				while (b < M.size() && M[b].segm_id() == M[b-1].segm_id() && M[b].hit_r() + params.k <= M[b-1].hit_r() + P_len)
+					++b;
+				if (b < M.size())
+					bounds.push_back(b);
+			}
+			bounds.push_back(M.size());
+
+			// The largest position before each part
+			vector<pos_t> max_T_l(bounds.size() - 1, 0);
+			for (size_t i = 1; i < max_T_l.size(); i++) {
+				max_T_l[i] = max_T_l[i-1];
+				for (size_t j = bounds[i-1]; j < bounds[i]; j++)
+					max_T_l[i] = std::max(max_T_l[i], M[j].hit_r());
+			}
+
+			// The parts are not in the arena of this thread. They run in waves of
+			// one part per thread, so at most a wave of mappings is stored.
+			auto *mr = std::pmr::new_delete_resource();
+			const size_t n_parts = bounds.size() - 1;
+			vector<mappings_t> part_mappings(n_parts), part_held(n_parts);
+			vector<std::unique_ptr<ReasonableFilter>> part_filters(n_parts);
+			for (size_t wave = 0; wave < n_parts; wave += pool->size()) {
+				const size_t wave_end = std::min(wave + pool->size(), n_parts);
+				pool->parallel_for(wave_end - wave, [&](size_t j) {
+					const size_t i = wave + j;
+					DiffHist hist(diff_hist, mr);
+					part_mappings[i] = mappings_t(mr);
+					part_held[i] = mappings_t(mr);
+					if (reasonable) {
+						part_filters[i].reset(new ReasonableFilter(&part_mappings[i], P_len, params.tThres, mr));
+						if (i > 0)
+							part_filters[i]->hold(&part_held[i], max_T_l[i]);
+					}
+					(this->*kernel)(hist, M, M.begin() + bounds[i], M.begin() + bounds[i+1], P_len, thin_seeds_cnt, tThres,
+							part_filters[i].get(), &part_mappings[i]);
+				});
+				for (size_t i = wave; i < wave_end; i++) {
+					if (reasonable)
+						reasonable->join(*part_filters[i], part_held[i], part_mappings[i]);
+					else
+						mappings.insert(mappings.end(), part_mappings[i].begin(), part_mappings[i].end());
+					part_mappings[i] = mappings_t(mr);
+					part_held[i] = mappings_t(mr);
+					part_filters[i].reset();
+				}
+			}
+		}
+		if (reasonable)
+			reasonable->finish();
+		return mappings;
+	}
+
+	// The instance of the sweep kernel for a sweep mode.
+	static sweep_kernel_t sweep_kernel(SweepMode mode) {
+		switch (mode) {
+			case SweepMode::BEST: return &SweepMap::sweep_range<SweepMode::BEST>;
+			case SweepMode::TOP:  return &SweepMap::sweep_range<SweepMode::TOP>;
+			case SweepMode::ALL:  return &SweepMap::sweep_range<SweepMode::ALL>;
+		}
+		return nullptr;
+	}
+
+	// Whether the rest of an --onlybest sweep, whose windows intersect the
+	// pattern in at most `rest_bound` kmers, can change neither the best
+	// mapping nor its MAPQ. Only the reported J2 may still grow.
+	static bool settled(const Mapping &best, const Mapping &second, int rest_bound, int thin_seeds_cnt) {
+		if (rest_bound > best.xmin)
+			return false;
+		const double J_bound = double(rest_bound) / std::max(thin_seeds_cnt, 1);  // J <= xmin / seeds
+		return best.xmin <= 5 || best.J <= 0.1 || best.J > 1.2 * std::max(second.J, J_bound);
+	}
+
 	// vector<hash_t> diff_hist;  // diff_hist[kmer_hash] = #occurences in `p` - #occurences in `s`
 	// vector<Match> M;   	   // for all kmers from P in T: <kmer_hash, last_kmer_pos_in_T> * |P| sorted by second
-	const vector<Mapping> sweep(hist_t &diff_hist, const Sketch &p, const vector<Match> &M, const pos_t P_len, const int thin_seeds_cnt) {
+	// Sweeps the windows starting in [first, last), which has to start with
+	// an empty window, and passes the mappings to `reasonable` if given, or
+	// else appends them to `mappings`. Only --onlybest and --top use the
+	// counters. Instantiated for each SweepMode, so that the window loop has
+	// no branches on the mode and the threshold stays in a register.
+	template<SweepMode MODE>
+	MULTIVERSION
+	void sweep_range(DiffHist &diff_hist, const matches_t &M, matches_t::const_iterator first, matches_t::const_iterator last,
+			const pos_t P_len, const int thin_seeds_cnt, const double tThres, ReasonableFilter *reasonable, mappings_t *mappings) {
 //		const int MAX_BL = 100;
-		vector<Mapping> mappings;	// List of tripples <i, j, score> of matches
+		constexpr bool BEST = MODE == SweepMode::BEST;
+		constexpr bool PRUNE = MODE != SweepMode::ALL;  // with bounds on the buckets
+		const int k = params.k;
 
 		int xmin = 0;
-		Mapping best(params.k, P_len, 0, -1, -1, -1, -1, -1, 0, M.end(), M.end());
+		Mapping best(k, P_len, 0, -1, -1, -1, -1, -1, 0, M.end(), M.end());
 		Mapping second = best;
 		int same_strand_seeds = 0;  // positive for more overlapping strands (fw/fw or bw/bw); negative otherwise
 
+		auto add = [&](matches_t::const_iterator r) {
+			same_strand_seeds += r->is_same_strand() ? +1 : -1;
+			// If taking this kmer from T increases the intersection with P.
+			if (diff_hist.dec(r->seed_num()))
+				++xmin;
+		};
+		auto remove = [&](matches_t::const_iterator l) {
+			if (diff_hist.inc(l->seed_num()))
+				--xmin;
+			same_strand_seeds -= l->is_same_strand() ? +1 : -1;
+		};
+
+		buckets_t buckets(&arena);
+		if constexpr (PRUNE) {
+			assert(first == M.begin() && last == M.end());
+			buckets = bound_buckets(M, P_len);
+		}
+		size_t next_bucket = 0;
+
 		// Increase the left point end of the window [l,r) one by one. O(matches)
-		for(auto l = M.begin(), r = M.begin(); l != M.end(); ++l) {
+		for(auto l = first, r = first; l != last; ++l) {
+			if constexpr (PRUNE) {
+				// Skip the windows starting in buckets that cannot change the best
+				// or the second best mapping. The window state after the skip is
+				// the same as after sweeping over the buckets.
+				// With --top, the windows that cannot get into the top are skipped
+				// the same way, below the xmin of the last kept mapping.
+				const int floor = BEST ? second.xmin : reasonable->floor();
+				if (next_bucket < buckets.size() && l - M.begin() == buckets[next_bucket].from
+						&& (BEST ? settled(best, second, buckets[next_bucket].rest_bound, thin_seeds_cnt)
+								: buckets[next_bucket].rest_bound <= floor)) {
+					C->inc("early_exits");
+					C->inc("pruned_matches", last - l);
+					for (; l != r; ++l)
+						remove(l);
+					break;
+				}
+				while (next_bucket < buckets.size() && l - M.begin() == buckets[next_bucket].from) {
+					const auto &b = buckets[next_bucket];
+					const bool prune_segm = b.segm_bound <= floor;
+					if (!prune_segm && !(b.bound <= floor || (BEST && b.bound <= best.xmin && b.max_T_l <= best.T_l + 0.9*P_len))) {
+						++next_bucket;
+						break;
+					}
+					auto to = M.begin() + (prune_segm ? b.segm_to : b.to);
+					C->inc("pruned_matches", to - l);
+					for (; l != to && l != r; ++l)
+						remove(l);
+					l = to;
+					r = std::max(r, to);
+					while (next_bucket < buckets.size() && buckets[next_bucket].from < to - M.begin())
+						++next_bucket;
+				}
+				if (l == last)
+					break;
+			}
+
 			// Increase the right end of the window [l,r) until it gets out.
-			for(;  r != M.end()
-				&& l->hit.segm_id == r->hit.segm_id   // make sure they are in the same segment since we sweep over all matches
-				&& r->hit.r + params.k <= l->hit.r + P_len
+			for(;  r != last
+				&& l->segm_id() == r->segm_id()   // make sure they are in the same segment since we sweep over all matches
+				&& r->hit_r() + k <= l->hit_r() + P_len
 				; ++r) {
-				same_strand_seeds += r->is_same_strand() ? +1 : -1;  // change to r inside the loop
-				// If taking this kmer from T increases the intersection with P.
 				// TODO: iterate following seeds
-				if (--diff_hist[r->seed_num] >= 0)
-					++xmin;
-				assert (l->hit.r <= r->hit.r);
+				add(r);
+				assert (l->hit_r() <= r->hit_r());
 			}
 
-			auto m = Mapping(params.k, P_len, thin_seeds_cnt, l->hit.r, prev(r)->hit.r, l->hit.segm_id, pos_t(r-l), xmin, same_strand_seeds, l, r);
+			auto m = Mapping(k, P_len, thin_seeds_cnt, l->hit_r(), prev(r)->hit_r(), l->segm_id(), pos_t(r-l), xmin, same_strand_seeds, l, r);
 
 			// second best without guarantees
 			// Wrong invariant:
 			// best[l,r) -- a mapping best.l<=l with maximal J
 			// second_best[l,r) -- a mapping second_best.l \notin [l-90%|P|; l+90%|P|] with maximal J
-			if (params.onlybest) {
+			if constexpr (BEST) {
 				if (m.xmin > best.xmin) {  // if (xmin > best.xmin)
 					if (best.T_l < m.T_l - 0.9*P_len)
 						second = best;
@@ -248,173 +857,609 @@ class SweepMap {
 					second = m;
 				}
 			} else {
-				if (m.J > params.tThres) {
-					mappings.push_back(m);
+				if (m.J > tThres) {
+					if (reasonable)
+						reasonable->push(m);
+					else
+						mappings->push_back(m);
 				}
 			}
 
 			// Prepare for the next step by moving `l` to the right.
-			if (++diff_hist[l->seed_num] > 0)
-				--xmin;
-			same_strand_seeds -= l->is_same_strand() ? +1 : -1;
+			remove(l);
 
 			assert(xmin >= 0);
 		}
 		assert(xmin == 0);
 		assert(same_strand_seeds == 0);
 
-		if (params.onlybest && best.xmin != -1) { // && best.J > params.tThres)
+		if (BEST && best.xmin != -1) { // && best.J > params.tThres)
 			best.mapq = (best.xmin > 5 && best.J > 0.1 && best.J > 1.2*second.J) ? 60 : 0;
 			best.J2 = second.J;
-			mappings.push_back(best);
+			mappings->push_back(best);
 		}
-
-		return mappings;
 	}
 
-	// Return only reasonable matches (i.e. those that are not J-dominated by
-	// another overlapping match). Runs in O(|all|).
-	vector<Mapping> filter_reasonable(const vector<Mapping> &all, const pos_t P_len) {
-		vector<Mapping> reasonable;
-		std::deque<Mapping> recent;
-
-		// Minimal separation between mappings to be considered reasonable
-		pos_t sep = pos_t((1.0 - params.tThres) * double(P_len));
-
-		// The deque `recent' is sorted decreasingly by J
-		//					  _________`recent'_________
-		//                   /                          \
-		// ---------------- | High J ... Mid J ... Low J | current J
-		// already removed    deque.back ... deque.front    to add next
-		for (const auto &next: all) {
-			// 1. Prepare for adding `curr' by removing from the deque back all
-			//    mappings that are too far to the left. This keeps the deque
-			//    within |P| from back to front. A mapping can become reasonable
-			//    only after getting removed.
-			while(!recent.empty() && next.T_l - recent.back().T_l > sep) {
-				// If the mapping is not marked as unreasonable (coverted by a preivous better mapping)
-				if (!recent.back().unreasonable) {
-					// Take the leftmost mapping.
-					reasonable.push_back(recent.back());
-					// Mark the next closeby mappings as not reasonable
-					for (auto it=recent.rbegin(); it!=recent.rend() && it->T_l - recent.back().T_l < sep; ++it)
-						it->unreasonable = true;
-				}
-				// Remove the mapping that is already too much behind.
-				recent.pop_back();
-			}
-			assert(recent.empty() || (recent.back().T_r <= recent.front().T_r && recent.front().T_r <= next.T_r));
-
-			// Now all the mappings in `recent' are close to `curr' 
-			// 2. Remove from the deque front all mappings that are strictly
-			//    less similar than the current J. This keeps the deque sorted
-			//    descending in J from left to right
-			while(!recent.empty() && recent.front().xmin < next.xmin)
-				recent.pop_front();
-			assert(recent.empty() || (recent.back().xmin >= recent.front().xmin && recent.front().xmin >= next.xmin));
-
-			// 3. Add the next mapping to the front
-			recent.push_front(next);	 
-
-			// 4. If there is another mapping in the deque, it is near and better.
-			if (recent.size() > 1)
-				recent.front().unreasonable = true;
-		}
 
-		// 5. Add the last mapping if it is reasonable
-		if (!recent.empty() && !recent.back().unreasonable)
-			reasonable.push_back(recent.back());
-
-		return reasonable;
-	}
-
-    // TODO: disable in release
-    int spurious_matches(const Mapping &m, const vector<Match> &matches) {
+    // The matches of a read outside of its mapping `m`; a diagnostic.
+    int spurious_matches(const Mapping &m, const matches_t &matches) {
         int included = 0;
         for (auto &match: matches)
-            if (match.hit.segm_id == m.segm_id && match.hit.r >= m.T_l && match.hit.r <= m.T_r)
+            if (match.segm_id() == m.segm_id && match.hit_r() >= m.T_l && match.hit_r() <= m.T_r)
                 included++;
         return matches.size() - included;
     }
 
   public:
-	SweepMap(const SketchIndex &tidx, const params_t &params, Timers *T, Counters *C)
-		: tidx(tidx), params(params), T(T), C(C) {
+	SweepMap(const SketchIndex &tidx, const params_t &params, Timers *T, Counters *C, std::ostream &out = std::cout)
+		: tidx(tidx), params(params), T(T), C(C), out(out),
+		  sweep_mode(params.onlybest ? SweepMode::BEST : params.top > 0 ? SweepMode::TOP : SweepMode::ALL) {
 			C->inc("seeds_limit_reached", 0);
 			C->inc("unmapped_reads", 0);
+			C->inc("spurious_matches", 0);
+			C->inc("J", 0);
+			C->inc("mappings", 0);
+			C->inc("sketched_kmers", 0);
+			C->inc("total_edit_distance", 0);
 			if (params.tThres < 0.0 || params.tThres > 1.0) {
 				cerr << "tThres = " << params.tThres << " outside of [0,1]." << endl;
 				exit(1);
 			}
 		}
 
-	void map(const string &pFile) {
-		C->inc("spurious_matches", 0);
-		C->inc("J", 0);
-		C->inc("mappings", 0);
-		C->inc("sketched_kmers", 0);
-		C->inc("total_edit_distance", 0);
+	// The mappings of a read of length P_sz with sketch `p`, whose matches
+	// refer to `thin_seeds` and `matches` (in the arena). At most `max_seeds`
+	// seeds are taken, with at most `match_budget` matches (0: no limit).
+	mappings_t find_mappings(pos_t P_sz, const Sketch &p, int max_seeds, int match_budget, SweepMode mode, seeds_t *thin_seeds, matches_t *matches) {
+		hist_t p_hist(&arena);
+		T->start("seeding");
+		*thin_seeds = select_seeds(p, max_seeds, match_budget, &p_hist);
+		T->stop("seeding");
 
-		T->start("mapping");
-		T->start("query_reading");
-		read_fasta_klib(pFile, [this](kseq_t *seq) {
-			T->stop("query_reading");
-			T->start("query_mapping");
-			T->start("sketching");
-			Sketch p(seq->seq.s);
-			T->stop("sketching");
-
-			string query_id = seq->name.s;
-			pos_t P_sz = (pos_t)seq->seq.l;
-
-			C->inc("read_len", P_sz);
-			hist_t p_hist;
-
-			Timer read_mapping_time;
-			read_mapping_time.start();
-			T->start("seeding");
-			vector<Seed> thin_seeds = select_seeds(p, &p_hist);
-			T->stop("seeding");
-
-			T->start("matching");
-			vector<Match> matches = match_seeds(p.kmers.size(), thin_seeds);
-			T->stop("matching");
-
-			T->start("sweep");
-			vector<Mapping> mappings = sweep(p_hist, p, matches, P_sz, thin_seeds.size());
-			T->stop("sweep");
-
-			T->start("postproc");
-			if (!params.overlaps)
-				mappings = filter_reasonable(mappings, P_sz);
-			read_mapping_time.stop();
-
-			for (auto &m: mappings) {
-				const auto &segm = tidx.T[m.segm_id];
-				m.map_time = read_mapping_time.secs() / (double)mappings.size();
-				if (params.sam) {
-					auto ed = m.print_sam(query_id, segm, (int)matches.size(), seq->seq.s, seq->seq.l);
-					C->inc("total_edit_distance", ed);
+		// Two-level mapping: all seeds are matched only inside the regions
+		// found by the coarse seeds, or everywhere if there are none.
+		regions_t regions(&arena);
+		if (params.coarse > 0.0) {
+			T->start("coarse");
+			regions = coarse_regions(p, *thin_seeds, p_hist, P_sz);
+			if (regions.empty())
+				C->inc("coarse_fallbacks");
+			T->stop("coarse");
+		}
+
+		T->start("matching");
+		*matches = match_seeds(p.kmers.size(), *thin_seeds, regions.empty() ? nullptr : &regions);
+		renumber_seeds(thin_seeds, &p_hist, matches);
+		T->stop("matching");
+
+		T->start("sweep");
+		mappings_t mappings = sweep(p_hist, p, *matches, P_sz, thin_seeds->size(), mode, params.tThres);
+		T->stop("sweep");
+		return mappings;
+	}
+
+	// Maps one query given its sketch. `seq` is needed only for SAM output.
+	void map_read(const string &query_id, pos_t P_sz, const Sketch &p, const char *seq) {
+		C->inc("read_len", P_sz);
+		if (params.chunk_len > 0 && P_sz > params.chunk_len + params.chunk_len / 2) {
+			map_read_chunked(query_id, P_sz, p, seq);
+			return;
+		}
+		arena.reset();
+
+		Timer read_mapping_time;
+		read_mapping_time.start();
+		seeds_t thin_seeds(&arena);
+		matches_t matches(&arena);
+		mappings_t mappings = find_mappings(P_sz, p, seed_limit(P_sz), params.match_budget, sweep_mode, &thin_seeds, &matches);
+
+		T->start("postproc");
+		read_mapping_time.stop();
+
+		for (auto &m: mappings) {
+			const auto &segm = tidx.T[m.segm_id];
+			m.map_time = read_mapping_time.secs() / (double)mappings.size();
+			if (params.sam) {
+				auto ed = m.print_sam(out, query_id, segm, (int)matches.size(), seq, P_sz);
+				C->inc("total_edit_distance", ed);
+			}
+			else m.print_paf(out, query_id, segm, thin_seeds, matches);
+			if constexpr (DIAGNOSTICS)
+				C->inc("spurious_matches", spurious_matches(m, matches));
+			C->inc("J", int(10000.0*m.J));
+			C->inc("mappings");
+			C->inc("sketched_kmers", m.seeds);
+		}
+		C->inc("matches", matches.size());
+		C->inc("reads");
+		if (mappings.empty())
+			C->inc("unmapped_reads");
+		T->stop("postproc");
+	}
+
+	// A mapping of a chunk of a long read, in the coordinates of the read.
+	struct ChunkMapping {
+		int chunk;
+		Mapping m;               // its matches are gone with the chunk
+		pos_t P_start, P_end;    // the seeded part of the read
+		pos_t P_first, T_first;  // the first and the last match on the diagonal
+		pos_t P_last, T_last;    //   of the mapping (see chunk_anchors)
+		size_t matches;          // of the chunk
+		int spurious;            // matches of the chunk outside of the mapping (DIAGNOSTICS)
+	};
+
+	// The first and the last match (in the read) of the mapping `m` of the
+	// chunk at `from` among the matches on its main diagonal (T-P on the
+	// forward strand and T+P on the reverse), the densest `band` of
+	// diagonals. So neither a spurious match at an end of the sweep window
+	// nor the matches of the repeats near the locus move the anchors.
+	void chunk_anchors(const Mapping &m, const seeds_t &thin_seeds, pos_t from, pos_t band, ChunkMapping *c) {
+		auto diagonal = [&](const Match &match) {
+			const pos_t P = thin_seeds[match.seed_num()].r_first;
+			return m.strand == '+' ? match.hit_r() - P : match.hit_r() + P;
+		};
+		std::pmr::vector<pos_t> diagonals(&arena);
+		diagonals.reserve(m.r - m.l);
+		for (auto match = m.l; match != m.r; ++match)
+			diagonals.push_back(diagonal(*match));
+		std::sort(diagonals.begin(), diagonals.end());
+		size_t densest = 0, most = 0;
+		for (size_t i = 0, j = 0; j < diagonals.size(); j++) {
+			while (diagonals[j] - diagonals[i] > band)
+				i++;
+			if (j - i + 1 > most)
+				most = j - i + 1, densest = i;
+		}
+		const pos_t lo = diagonals[densest], hi = diagonals[densest] + band;
+
+		c->P_first = std::numeric_limits<pos_t>::max(), c->P_last = -1;
+		for (auto match = m.l; match != m.r; ++match) {
+			if (diagonal(*match) < lo || diagonal(*match) > hi)
+				continue;
+			const pos_t P = from + thin_seeds[match->seed_num()].r_first;
+			if (P < c->P_first)
+				c->P_first = P, c->T_first = match->hit_r();
+			if (P > c->P_last)
+				c->P_last = P, c->T_last = match->hit_r();
+		}
+	}
+
+	// Chains the chunk mappings (in the order of the chunks) that are on the
+	// same segment and strand and colinear: from the last anchor of a chunk
+	// mapping to the first anchor of the next one, the read and the reference
+	// advance by the same distance up to CHAIN_SLACK of the distance and of
+	// the chunk length. A chain may skip up to MAX_CHUNK_SKIP chunks without
+	// such a mapping. The chains are taken by decreasing intersection, each
+	// chunk mapping in one chain, and merged into mappings of the whole read
+	// with `seeds` seeds: the best one with --onlybest, or else the ones with
+	// J above the threshold (the first --top of them by intersection).
+	vector<ChunkMapping> stitch(const vector<ChunkMapping> &nodes, pos_t P_sz, int seeds) const {
+		vector<int64_t> score(nodes.size());
+		vector<int> pred(nodes.size(), -1);
+		for (size_t b = 0; b < nodes.size(); b++) {
+			score[b] = nodes[b].m.xmin;
+			for (size_t a = b; a-- > 0 && nodes[a].chunk >= nodes[b].chunk - MAX_CHUNK_SKIP - 1; ) {
+				const auto &x = nodes[a], &y = nodes[b];
+				if (x.chunk == y.chunk || x.m.segm_id != y.m.segm_id || x.m.strand != y.m.strand || y.P_last <= x.P_last)
+					continue;
+				const pos_t dP = y.P_first - x.P_last;
+				const pos_t dT = y.m.strand == '+' ? y.T_first - x.T_last : x.T_last - y.T_first;
+				if (std::abs(dT - dP) <= CHAIN_SLACK * (std::abs(dP) + params.chunk_len)
+						&& score[a] + y.m.xmin > score[b]) {
+					score[b] = score[a] + y.m.xmin;
+					pred[b] = a;
 				}
-				else m.print_paf(query_id, segm, matches);
-                C->inc("spurious_matches", spurious_matches(m, matches));
-				C->inc("J", int(10000.0*m.J));
-				C->inc("mappings");
-				C->inc("sketched_kmers", m.seeds);
 			}
-			C->inc("matches", matches.size());
-			C->inc("reads");
-			if (mappings.empty())
-				C->inc("unmapped_reads");
-			T->stop("postproc");
+		}
+
+		vector<int> order(nodes.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), [&score](int a, int b) { return score[a] > score[b]; });
+		vector<bool> used(nodes.size(), false);
+		vector<ChunkMapping> stitched;
+		for (int end: order) {
+			if (used[end])
+				continue;
+			ChunkMapping s = nodes[end];
+			s.m.P_sz = P_sz;
+			s.m.seeds = seeds;
+			s.m.s_sz = s.m.xmin = 0;
+			s.matches = 0;
+			s.spurious = 0;
+			int begin = end;
+			for (int v = end; v != -1 && !used[v]; v = pred[v]) {
+				used[v] = true;
+				begin = v;
+				const auto &x = nodes[v];
+				s.m.s_sz += x.m.s_sz;
+				s.m.xmin += x.m.xmin;
+				s.m.mapq = std::min(s.m.mapq, x.m.mapq);
+				if (params.onlybest)
+					s.m.J2 = std::max(s.m.J2, x.m.J2);
+				s.P_start = std::min(s.P_start, x.P_start);
+				s.P_end = std::max(s.P_end, x.P_end);
+				s.matches += x.matches;
+				s.spurious += x.spurious;
+			}
+			// The reference range by the anchors at the ends of the chain, as
+			// the ends of the sweep windows of the chunks may be off.
+			const auto &first = nodes[begin], &last = nodes[end];
+			if (s.m.strand == '+') {
+				s.m.T_l = first.T_first - (first.P_first - s.P_start);
+				s.m.T_r = last.T_last + (s.P_end - last.P_last);
+			} else {
+				s.m.T_l = last.T_last - (s.P_end - last.P_last);
+				s.m.T_r = first.T_first + (first.P_first - s.P_start);
+			}
+			s.m.J = double(s.m.xmin) / std::max(s.m.seeds, s.m.s_sz);
+			if (params.onlybest) {
+				stitched.push_back(s);
+				break;
+			}
+			if (s.m.J > params.tThres)
+				stitched.push_back(s);
+		}
+		// --top: the first ones by xmin, in the order of ReasonableFilter::finish()
+		if (params.top > 0 && !params.onlybest) {
+			std::sort(stitched.begin(), stitched.end(), [](const ChunkMapping &a, const ChunkMapping &b) {
+				if (a.m.xmin != b.m.xmin)
+					return a.m.xmin > b.m.xmin;
+				return a.m.segm_id != b.m.segm_id ? a.m.segm_id < b.m.segm_id : a.m.T_l < b.m.T_l;
+			});
+			if (stitched.size() > size_t(params.top))
+				stitched.resize(params.top);
+		}
+		return stitched;
+	}
+
+	// Maps a read longer than 1.5*chunk_len in chunks of equal length of at
+	// most chunk_len that overlap by CHUNK_OVERLAP of it, so the sweep window
+	// is bounded by the chunk length and a structural variant breaks only a
+	// chunk. The chunks are mapped independently, each with its share of the
+	// seed limit and of the match budget of the read: in parallel as subtasks
+	// of the pool, or else one after another in the arena of this SweepMap.
+	// Their colinear mappings are stitched into mappings of the whole read.
+	void map_read_chunked(const string &query_id, pos_t P_sz, const Sketch &p, const char *seq) {
+		Timer read_mapping_time;
+		read_mapping_time.start();
+
+		const pos_t overlap = pos_t(CHUNK_OVERLAP * params.chunk_len);
+		const pos_t step = params.chunk_len - overlap;
+		const int chunks = (P_sz - overlap + step - 1) / step;
+		const int max_seeds = seed_limit(P_sz);
+		// --top applies to the stitched mappings, so the chunks keep all
+		const SweepMode chunk_mode = sweep_mode == SweepMode::TOP ? SweepMode::ALL : sweep_mode;
+
+		vector<vector<ChunkMapping>> chunk_nodes(chunks);
+		vector<int> chunk_seeds(chunks);
+		// Maps chunk `i` with `sm`, which owns the arena, Timers and Counters.
+		auto map_chunk = [&](SweepMap &sm, int i) {
+			// [from, to) in the read
+			const pos_t from = pos_t(int64_t(P_sz - overlap) * i / chunks);
+			const pos_t to = pos_t(int64_t(P_sz - overlap) * (i+1) / chunks) + overlap;
+			const double share = double(to - from) / P_sz;
+			sm.arena.reset();
 
+			Sketch::sketch_t kmers;
+			for (auto it = std::lower_bound(p.kmers.begin(), p.kmers.end(), from + params.k, [](const Kmer &kmer, pos_t r) {
+					return kmer.r < r;
+				}); it != p.kmers.end() && it->r <= to; ++it)
+				kmers.push_back(Kmer(it->r - from, it->h, it->strand));
+			const Sketch chunk(std::move(kmers));
+
+			seeds_t thin_seeds(&sm.arena);
+			matches_t matches(&sm.arena);
+			const int match_budget = params.match_budget > 0 ? std::max(1, int(share * params.match_budget)) : 0;
+			for (const auto &m: sm.find_mappings(to - from, chunk, std::max(1, int(share * max_seeds)), match_budget, chunk_mode, &thin_seeds, &matches)) {
+				int P_start, P_end;
+				m.query_range(thin_seeds, &P_start, &P_end);
+				ChunkMapping c{i, m, from + P_start, from + P_end, 0, 0, 0, 0, matches.size(), DIAGNOSTICS ? sm.spurious_matches(m, matches) : 0};
+				sm.chunk_anchors(m, thin_seeds, from, pos_t(CHAIN_SLACK * (to - from)), &c);
+				chunk_nodes[i].push_back(c);
+			}
+			chunk_seeds[i] = thin_seeds.size();
+			sm.C->inc("matches", matches.size());
+		};
+		if (pool && pool->size() > 1) {
+			// Every chunk is a subtask of bounded work with a SweepMap (arena,
+			// Timers and Counters) of its own; subtasks must not use the state
+			// of the worker.
+			vector<Timers> chunk_T(chunks);
+			vector<Counters> chunk_C(chunks);
+			pool->parallel_for(chunks, [&](size_t i) {
+				SweepMap sm(tidx, params, &chunk_T[i], &chunk_C[i], out);
+				map_chunk(sm, int(i));
+			});
+			for (int i = 0; i < chunks; i++) {
+				T->merge(chunk_T[i]);
+				C->merge(chunk_C[i]);
+			}
+		} else {
+			for (int i = 0; i < chunks; i++)
+				map_chunk(*this, i);
+		}
+
+		vector<ChunkMapping> nodes;
+		for (const auto &mappings: chunk_nodes)
+			nodes.insert(nodes.end(), mappings.begin(), mappings.end());
+		const int seeds = std::accumulate(chunk_seeds.begin(), chunk_seeds.end(), 0);
+
+		T->start("postproc");
+		vector<ChunkMapping> mappings = stitch(nodes, P_sz, seeds);
+		read_mapping_time.stop();
+
+		for (auto &[chunk, m, P_start, P_end, P_first, T_first, P_last, T_last, matches, spurious]: mappings) {
+			const auto &segm = tidx.T[m.segm_id];
+			m.map_time = read_mapping_time.secs() / (double)mappings.size();
+			if (params.sam) {
+				auto ed = m.print_sam(out, query_id, segm, (int)matches, seq, P_sz);
+				C->inc("total_edit_distance", ed);
+			}
+			else m.print_paf(out, query_id, segm, P_start, P_end, matches);
+			if constexpr (DIAGNOSTICS)
+				C->inc("spurious_matches", spurious);
+			C->inc("J", int(10000.0*m.J));
+			C->inc("mappings");
+			C->inc("sketched_kmers", m.seeds);
+		}
+		C->inc("reads");
+		C->inc("chunked_reads");
+		C->inc("read_chunks", chunks);
+		if (mappings.empty())
+			C->inc("unmapped_reads");
+		T->stop("postproc");
+	}
+	// Sketches the reads [from, to) of a batch together and maps them. Long
+	// reads are sketched in pieces by the subtasks of the pool.
+	void map_fasta_reads(const vector<Read> &batch, size_t from, size_t to) {
+		T->start("sketching");
+		vector<std::string_view> seqs;
+		vector<size_t> short_reads;
+		vector<Sketch::sketch_t> sketches(to - from);
+		for (size_t i = from; i < to; i++) {
+			if (pool && pool->size() > 1 && batch[i].seq.size() >= SPLIT_LEN) {
+				sketches[i-from] = Sketch::buildSketchParts(batch[i].seq, batch[i].seq.size() / SPLIT_PART_LEN, *pool);
+			} else {
+				seqs.push_back(batch[i].seq);
+				short_reads.push_back(i-from);
+			}
+		}
+		auto short_sketches = Sketch::buildSketchBatch(seqs);
+		for (size_t j = 0; j < short_reads.size(); j++)
+			sketches[short_reads[j]] = std::move(short_sketches[j]);
+		T->stop("sketching");
+
+		for (size_t i = from; i < to; i++) {
+			T->start("query_mapping");
+			map_read(batch[i].name, (pos_t)batch[i].seq.size(), Sketch(std::move(sketches[i-from])), batch[i].seq.c_str());
 			T->stop("query_mapping");
-			T->start("query_reading");
+		}
+	}
+
+	// A read loaded from a sketch file.
+	struct SketchedRead {
+		string name;
+		pos_t P_sz;
+		Sketch::sketch_t kmers;
+	};
+
+	void map_sketched_read(SketchedRead &read) {
+		T->start("query_mapping");
+		T->start("sketching");
+		Sketch p(std::move(read.kmers));
+		C->inc("sketched_seqs");
+		C->inc("sketched_len", read.P_sz);
+		C->inc("original_kmers", p.kmers.size());
+		C->inc("sketched_kmers", p.kmers.size());
+		T->stop("sketching");
+		map_read(read.name, read.P_sz, p, nullptr);
+		T->stop("query_mapping");
+	}
+
+	// A chunk of consecutive reads passed between the pipeline stages.
+	struct Chunk {
+		vector<Read> reads;             // FASTA queries
+		vector<SketchedRead> sketched;  // or queries from a sketch file
+		string output;                  // the mappings of the reads, filled by a mapper
+		std::atomic<bool> mapped{false};  // `output` is ready
+	};
+	using ChunkPtr = std::unique_ptr<Chunk>;
+
+	// Chunks are weighted by read length: a chunk ends after CHUNK_READS
+	// reads or CHUNK_LEN nucleotides, so a long read makes a chunk of its own.
+	static constexpr size_t CHUNK_READS = 64;  // short reads are sketched together in SIMD lanes
+	static constexpr size_t CHUNK_LEN = 1'000'000;
+	// Reads of at least SPLIT_LEN nucleotides are sketched in pieces of
+	// SPLIT_PART_LEN and their seeds are collected in parts of SPLIT_KMERS
+	// kmers, as subtasks that idle mappers steal.
+	static constexpr size_t SPLIT_LEN = 100'000;
+	static constexpr size_t SPLIT_PART_LEN = 50'000;
+	static constexpr size_t SPLIT_KMERS = 4096;
+	// The sweep over the matches of a read runs in parts of ~SPLIT_MATCHES.
+	static constexpr size_t SPLIT_MATCHES = 1 << 16;
+	// With --chunk_len, consecutive chunks of a long read overlap by
+	// CHUNK_OVERLAP of the chunk length, and their mappings are stitched if
+	// their anchors are off by at most CHAIN_SLACK of the chunk length and
+	// of the distance between them.
+	static constexpr double CHUNK_OVERLAP = 0.1;
+	static constexpr double CHAIN_SLACK = 0.1;
+	static constexpr int MAX_CHUNK_SKIP = 2;
+	// With --coarse and --onlybest, the regions of the coarse mappings with
+	// at least 1/COARSE_RIVAL of the best J are mapped with all seeds.
+	static constexpr double COARSE_RIVAL = 2.0;
+	// The index lookups are independent cache misses: a lookup prefetches
+	// the one PREFETCH_DIST kmers ahead, so that many of them are in flight.
+	static constexpr int PREFETCH_DIST = 16;
+	// From this many matches on, the radix sort is faster than pdqsort
+	// (see evals/bench_sort.cpp).
+	static constexpr size_t RADIX_SORT_MIN = 8192;
+
+	// The state of one mapping thread: its own SweepMap with its own
+	// counters, timers and output buffer over the shared index.
+	struct Worker {
+		Timers T;
+		Counters C;
+		std::ostringstream out;
+		std::unique_ptr<SweepMap> sweepmap;
+	};
+
+	// Pipeline stage statistics
+	Timer pipeline_time, reader_waiting, writer_waiting, writer_busy;
+	double mappers_busy = 0.0;
+	size_t stolen_tasks = 0;
+	vector<std::unique_ptr<Worker>> workers;
+	TaskPool *pool = nullptr;  // the pool of a mapping thread
+
+	void map_chunk(Chunk &chunk) {
+		if (!chunk.reads.empty())
+			map_fasta_reads(chunk.reads, 0, chunk.reads.size());
+		for (auto &read: chunk.sketched)
+			map_sketched_read(read);
+	}
+
+	// Maps the reads in a pipeline of three stages:
+	//   reader (this thread): calls `read_chunks(emit)`, which parses the
+	//                         queries and emits chunks of reads,
+	//   mappers (`threads`):  a work-stealing TaskPool that maps every chunk
+	//                         as a job on the Worker of the thread; long reads
+	//                         are split into subtasks,
+	//   writer:               writes the chunk outputs in the input order.
+	// The reader passes the chunks in the input order to the writer through
+	// a queue of `max_in_flight` chunks and submits them to the mappers. The
+	// reader blocks while the queue is full, which bounds the memory
+	// regardless of how far the mappers get ahead of a slow chunk, and the
+	// writer blocks until the next chunk is mapped. The output is the same
+	// as with a single thread.
+	void map_pipeline(const std::function<void(const std::function<void(ChunkPtr)>&)> &read_chunks) {
+		const size_t threads = params.threads;
+		const size_t max_in_flight = 4*threads + 4;
+		BoundedQueue<ChunkPtr> to_write(max_in_flight);
+		std::atomic<size_t> mapped_chunks(0);  // bumped after a chunk is mapped
+
+		for (size_t t = 0; t < threads; t++) {
+			workers.emplace_back(new Worker());
+			workers.back()->sweepmap.reset(new SweepMap(tidx, params, &workers.back()->T, &workers.back()->C, workers.back()->out));
+		}
+
+		pipeline_time.start();
+		TaskPool mappers(threads, [this](int w) {
+			Sketch::T = &workers[w]->T;
+			Sketch::C = &workers[w]->C;
 		});
-		T->stop("query_reading");
+		for (auto &w: workers)
+			w->sweepmap->pool = &mappers;
+
+		std::thread writer([&] {
+			ChunkPtr chunk;
+			while (to_write.pop(&chunk, &writer_waiting)) {
+				if (!chunk->mapped.load(std::memory_order_acquire)) {
+					writer_waiting.start();
+					while (true) {
+						const size_t seen = mapped_chunks.load();
+						if (chunk->mapped.load(std::memory_order_acquire))
+							break;
+						mapped_chunks.wait(seen);
+					}
+					writer_waiting.stop();
+				}
+				writer_busy.start();
+				out << chunk->output;
+				writer_busy.stop();
+			}
+			out.flush();
+		});
+
+		read_chunks([&](ChunkPtr chunk) {
+			// The writer frees the chunk only after it is mapped.
+			Chunk *to_map = chunk.get();
+			to_write.push(std::move(chunk), &reader_waiting);
+			mappers.submit([&, chunk = to_map] {
+				Worker &w = *workers[TaskPool::worker_id()];
+				w.sweepmap->map_chunk(*chunk);
+				chunk->output = w.out.str();
+				w.out.str("");
+				chunk->mapped.store(true, std::memory_order_release);
+				mapped_chunks.fetch_add(1);
+				mapped_chunks.notify_all();
+			});
+		});
+		mappers.wait();
+		to_write.close();
+		writer.join();
+		mappers.stop();
+		pipeline_time.stop();
+
+		mappers_busy = mappers.busy_secs();
+		stolen_tasks = mappers.stolen();
+		for (auto &w: workers) {
+			T->merge(w->T);
+			C->merge(w->C);
+		}
+	}
+
+	void map(const string &pFile) {
+		T->start("mapping");
+		if (SketchFile::is_sketch_file(pFile)) {
+			SketchFileReader reader(pFile);
+			if (reader.k != params.k || reader.hFrac != params.hFrac || reader.sampling != params.sampling) {
+				cerr << "ERROR: " << pFile << " was sketched with k=" << reader.k << ", hFrac=" << reader.hFrac << ", " << sampling_name(reader.sampling)
+					 << " but the index uses k=" << params.k << ", hFrac=" << params.hFrac << ", " << sampling_name(params.sampling) << "." << endl;
+				exit(1);
+			}
+			if (params.sam) {
+				cerr << "ERROR: SAM output needs the query sequences and is not supported for sketch files." << endl;
+				exit(1);
+			}
+			map_pipeline([&](const std::function<void(ChunkPtr)> &emit) {
+				ChunkPtr chunk(new Chunk());
+				size_t chunk_len = 0;
+				T->start("query_reading");
+				reader.read_all([&](const string &query_id, pos_t P_sz, Sketch::sketch_t &&kmers) {
+					chunk->sketched.push_back(SketchedRead{query_id, P_sz, std::move(kmers)});
+					chunk_len += P_sz;
+					if (chunk->sketched.size() == CHUNK_READS || chunk_len >= CHUNK_LEN) {
+						T->stop("query_reading");
+						emit(std::move(chunk));
+						chunk.reset(new Chunk());
+						chunk_len = 0;
+						T->start("query_reading");
+					}
+				});
+				T->stop("query_reading");
+				if (!chunk->sketched.empty())
+					emit(std::move(chunk));
+			});
+		} else {
+			map_pipeline([&](const std::function<void(ChunkPtr)> &emit) {
+				T->start("query_reading");
+				read_fasta_batches(pFile, CHUNK_READS, CHUNK_LEN, [&](vector<Read> &batch) {
+					T->stop("query_reading");
+					ChunkPtr chunk(new Chunk());
+					chunk->reads = std::move(batch);
+					emit(std::move(chunk));
+					T->start("query_reading");
+				});
+				T->stop("query_reading");
+			});
+		}
 		T->stop("mapping");
 
 		print_stats();
+		print_pipeline_stats();
+	}
+
+	// Utilization of the pipeline stages: the fraction of the pipeline time
+	// a stage was busy, and how long it was blocked.
+	void print_pipeline_stats() {
+		const double total = pipeline_time.secs();
+		cerr << std::fixed << std::setprecision(1);
+		cerr << "Pipeline (" << workers.size() << " mapping threads, " << total << " s):" << endl;
+		cerr << " | reader utilization:    " << setw(5) << right << 100.0 * T->secs("query_reading") / total << "% ("
+			 << reader_waiting.secs() << " s waiting for the writer)" << endl;
+		cerr << " | mapper utilization:    " << setw(5) << right << 100.0 * mappers_busy / (total * (double)workers.size()) << "% ("
+			 << stolen_tasks << " stolen tasks)" << endl;
+		cerr << " | writer utilization:    " << setw(5) << right << 100.0 * writer_busy.secs() / total << "% ("
+			 << writer_waiting.secs() << " s waiting for mappings)" << endl;
 	}
 
 	void print_stats() {
@@ -424,8 +1469,19 @@ class SweepMap {
 		cerr << " | Sketched read kmers:   " << C->count("sketched_kmers") << " (" << C->frac("sketched_kmers", "reads") << " per read)" << endl;
 		cerr << " | Kmer matches:          " << C->count("matches") << " (" << C->frac("matches", "reads") << " per read)" << endl;
 		cerr << " | Seed limit reached:    " << C->count("seeds_limit_reached") << " (" << C->perc("seeds_limit_reached", "reads") << "%)" << endl;
-		//cerr << " | Matches limit reached: " << C->count("matches_limit_reached") << " (" << C->perc("matches_limit_reached", "reads") << "%)" << endl;
-		cerr << " | Spurious matches:      " << C->count("spurious_matches") << " (" << C->perc("spurious_matches", "matches") << "%)" << endl;
+		cerr << " | Matches limit reached: " << C->count("matches_limit_reached") << " (" << C->perc("matches_limit_reached", "reads") << "%)" << endl;
+		if (params.chunk_len > 0)
+			cerr << " | Chunked reads:         " << C->count("chunked_reads") << " (" << C->frac("read_chunks", "chunked_reads") << " chunks per read)" << endl;
+		if (params.coarse > 0.0) {
+			cerr << " | Coarse matches:        " << C->count("coarse_matches") << " (" << C->frac("coarse_matches", "reads") << " per read)" << endl;
+			cerr << " | Coarse fallbacks:      " << C->count("coarse_fallbacks") << " (" << C->perc("coarse_fallbacks", "reads") << "%)" << endl;
+		}
+		if (params.onlybest || params.top > 0) {
+			cerr << " | Pruned matches:        " << C->count("pruned_matches") << " (" << C->perc("pruned_matches", "matches") << "%)" << endl;
+			cerr << " | Early exits:           " << C->count("early_exits") << " (" << C->perc("early_exits", "reads") << "%)" << endl;
+		}
+		if (DIAGNOSTICS)
+			cerr << " | Spurious matches:      " << C->count("spurious_matches") << " (" << C->perc("spurious_matches", "matches") << "%)" << endl;
 		cerr << " | Discarded seeds:       " << C->count("discarded_seeds") << " (" << C->perc("discarded_seeds", "collected_seeds") << "%)" << endl;
 		cerr << " | Unmapped reads:        " << C->count("unmapped_reads") << " (" << C->perc("unmapped_reads", "reads") << "%)" << endl;
 		cerr << " | Average Jaccard:       " << C->frac("J", "mappings") / 10000.0 << endl;
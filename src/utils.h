@@ -1,9 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <chrono>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <memory>
 #include <string>
 
@@ -50,94 +53,145 @@ public:
         assert(!running_);
         return max_ / min_;
     }
+
+    // Adds the time measured by another (stopped) timer, e.g. in another thread.
+    void merge(const Timer &other) {
+        assert(!other.running_);
+        accumulated_time_ += other.accumulated_time_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+};
+
+// Metric names -- all timers and counters are registered here. A name at a
+// call site like T->start("seeding") or C->inc("reads") is resolved to an
+// array index at compile time (an unregistered name does not compile), so
+// the metrics cost no string hashing on the per-read path. Every thread
+// counts into its own Timers and Counters, which are merged for the report.
+//
+// Timers have a level and the ones above SWEEPMAP_VERBOSITY compile to
+// nothing: 2 (default) keeps all, 1 removes the sub-stage timers of every
+// read, 0 keeps only the total times. 3 also turns on the DIAGNOSTICS,
+// which cost a pass over the matches of a read per mapping.
+#ifndef SWEEPMAP_VERBOSITY
+#define SWEEPMAP_VERBOSITY 2
+#endif
+inline constexpr bool DIAGNOSTICS = SWEEPMAP_VERBOSITY >= 3;
+
+struct TimerName {
+    const char *name;
+    int level;
+};
+
+inline constexpr TimerName TIMER_NAMES[] = {
+    {"total", 0}, {"mapping", 0},
+    {"indexing", 1}, {"index_reading", 1}, {"index_sketching", 1}, {"index_initializing", 1},
+    {"query_reading", 1}, {"query_mapping", 1}, {"sketching", 1},
+    {"seeding", 1}, {"coarse", 1}, {"matching", 1}, {"sweep", 1}, {"postproc", 1},
+    {"collect_seed_info", 2}, {"thin_sketch", 2}, {"sort_seeds", 2}, {"unique_seeds", 2},
+    {"collect_matches", 2}, {"sort_matches", 2},
+};
+
+inline constexpr const char *COUNTER_NAMES[] = {
+    // index
+    "segments", "total_nucls", "indexed_kmers", "indexed_hits", "indexed_highest_freq_kmer",
+    "blacklisted_kmers", "blacklisted_hits",
+    // sketching
+    "sketched_seqs", "sketched_len", "original_kmers", "sketched_kmers",
+    // mapping
+    "reads", "read_len", "collected_seeds", "discarded_seeds", "seeds_limit_reached", "matches_limit_reached",
+    "matches", "pruned_matches", "early_exits", "coarse_matches", "coarse_fallbacks", "chunked_reads", "read_chunks", "spurious_matches", "mappings", "unmapped_reads", "J", "total_edit_distance",
+};
+
+consteval bool same_name(const char *a, const char *b) {
+    while (*a && *a == *b)
+        ++a, ++b;
+    return *a == *b;
+}
+
+// The index of a registered timer; constructed only at compile time.
+struct TimerId {
+    int id;
+    int level;
+    consteval TimerId(const char *name) : id(-1), level(0) {
+        for (int i = 0; i < (int)std::size(TIMER_NAMES); i++)
+            if (same_name(TIMER_NAMES[i].name, name))
+                id = i, level = TIMER_NAMES[i].level;
+        if (id == -1)
+            throw "unregistered timer name";
+    }
+    constexpr bool enabled() const { return level <= SWEEPMAP_VERBOSITY; }
+};
+
+// The index of a registered counter; constructed only at compile time.
+struct CounterId {
+    int id;
+    consteval CounterId(const char *name) : id(-1) {
+        for (int i = 0; i < (int)std::size(COUNTER_NAMES); i++)
+            if (same_name(COUNTER_NAMES[i], name))
+                id = i;
+        if (id == -1)
+            throw "unregistered counter name";
+    }
 };
 
 class Timers {
 public:
-    std::unordered_map<std::string, Timer> timers_;
+    std::array<Timer, std::size(TIMER_NAMES)> timers_;
 
-    void start(const std::string& name) {
-        timers_[name].start();
+    void start(TimerId t) {
+        if (t.enabled())
+            timers_[t.id].start();
     }
 
-    void stop(const std::string& name) {
-        auto it = timers_.find(name);
-        if (it != timers_.end()) {
-            it->second.stop();
-        }
+    void stop(TimerId t) {
+        if (t.enabled())
+            timers_[t.id].stop();
     }
 
-    double secs(const std::string& name) const {
-        auto it = timers_.find(name);
-		assert(it != timers_.end());
-        if (it != timers_.end()) {
-            return it->second.secs();
-        }
-        assert(false);
-        return 0.0;
+    double secs(TimerId t) const {
+        return timers_[t.id].secs();
     }
 
-    double range_ratio(const std::string& name) const {
-        auto it = timers_.find(name);
-		assert(it != timers_.end());
-        if (it != timers_.end()) {
-            return it->second.range_ratio();
-        }
-        assert(false);
-        return 0.0;
-    }
-
-    double perc(const std::string& name, const std::string& total) const {
-        auto it = timers_.find(name);
-		assert(it != timers_.end());
-        auto it_total = timers_.find(total);
-		assert(it_total != timers_.end());
-        if (it != timers_.end()) {
-			if (it_total != timers_.end()) {
-				return it->second.secs() / it_total->second.secs() * 100.0;
-			}
-        }
-        return 0.0;
+    // 0 for a timer that never ran
+    double range_ratio(TimerId t) const {
+        return timers_[t.id].max_ < 0.0 ? 0.0 : timers_[t.id].range_ratio();
     }
-};
 
-class Counter {
-private:
-    int count_;
+    void merge(const Timers &other) {
+        for (size_t i = 0; i < timers_.size(); i++)
+            timers_[i].merge(other.timers_[i]);
+    }
 
-public:
-    Counter() : count_(0) {}
-    void inc(int value = 1) { count_ += value; }
-    int count() const { return count_; }
+    double perc(TimerId t, TimerId total) const {
+        return secs(t) / secs(total) * 100.0;
+    }
 };
 
 class Counters {
 private:
-    std::unordered_map<std::string, Counter> counters_;
+    std::array<int, std::size(COUNTER_NAMES)> counters_ = {};
 
 public:
-    void inc(const std::string& name, int value = 1) {
-		auto it = counters_.find(name);
-        if (it == counters_.end()) {
-            counters_[name] = Counter();
-			it = counters_.find(name);
-        }
-        counters_[name].inc(value);
+    void inc(CounterId c, int value = 1) {
+        counters_[c.id] += value;
+    }
+
+    void merge(const Counters &other) {
+        for (size_t i = 0; i < counters_.size(); i++)
+            counters_[i] += other.counters_[i];
     }
 
-    int count(const std::string& name) const {
-        assert(counters_.find(name) != counters_.end());
-        return counters_.at(name).count();
+    int count(CounterId c) const {
+        return counters_[c.id];
     }
 
-    double frac(const std::string& name, const std::string& total) const {
-        assert(counters_.find(name) != counters_.end());
-        assert(counters_.find(total) != counters_.end());
-        return double(counters_.at(name).count()) / double(counters_.at(total).count());
+    double frac(CounterId c, CounterId total) const {
+        return double(count(c)) / double(count(total));
 	}
 
-    double perc(const std::string& name, const std::string& total) const {
-		return 100.0 * frac(name, total);
+    double perc(CounterId c, CounterId total) const {
+		return 100.0 * frac(c, total);
 	}
 };
 